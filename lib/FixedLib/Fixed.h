@@ -0,0 +1,125 @@
+#ifndef Fixed_h
+#define Fixed_h
+
+#include <inttypes.h>
+
+// Число с фиксированной точкой Q(31-F).F в int32_t для регулирования без
+// float. Сложение, вычитание, умножение и деление насыщаются до
+// FIXED_MAX/FIXED_MIN вместо переполнения. Умножение и деление считаются в
+// int32_t, когда операнды малы (скорость и коэффициенты насоса в Q8), и
+// только иначе через int64_t
+#define FIXED_MAX 0x7FFFFFFFL
+#define FIXED_MIN (-FIXED_MAX - 1)
+
+template <uint8_t F> class Fixed {
+  static_assert(F > 0 && F < 31, "Fixed needs 1..30 fraction bits");
+
+private:
+  int32_t v;
+  static constexpr uint32_t HALF = static_cast<uint32_t>(1) << (F - 1);
+
+  static constexpr int32_t clamp(int64_t r) {
+    return r > FIXED_MAX ? FIXED_MAX : r < FIXED_MIN ? FIXED_MIN : r;
+  }
+  // |x| < 2^bits
+  static constexpr bool below(int32_t x, uint8_t bits) {
+    return x > -(1L << bits) && x < (1L << bits);
+  }
+  // произведение меньше 2^31 по модулю
+  static constexpr bool shortProduct(int32_t a, int32_t b) {
+    return (below(a, 15) && below(b, 16)) || (below(a, 16) && below(b, 15));
+  }
+
+public:
+  constexpr Fixed() : v(0) {}
+
+  static constexpr Fixed raw(int32_t r) { return Fixed(r, 0); }
+  static constexpr Fixed fromInt(int32_t i) {
+    return raw(below(i, 31 - F) ? i * (1L << F)
+               : i < 0            ? FIXED_MIN
+                                  : FIXED_MAX);
+  }
+  // n/d без float, для констант и перевода целых единиц
+  static constexpr Fixed ratio(int32_t n, int32_t d) {
+    return raw(below(n, 31 - F)
+                   ? n * (1L << F) / d
+                   : clamp(static_cast<int64_t>(n) * (1LL << F) / d));
+  }
+  static Fixed fromFloat(float f) {
+    f = f * (1L << F);
+    return raw(f >= FIXED_MAX ? FIXED_MAX
+               : f <= FIXED_MIN ? FIXED_MIN
+                                : static_cast<int32_t>(f < 0 ? f - 0.5F
+                                                             : f + 0.5F));
+  }
+
+  constexpr int32_t getRaw() const { return v; }
+  // с отбрасыванием дробной части, как присваивание float целому
+  constexpr int32_t toInt() const {
+    return v < 0 ? -static_cast<int32_t>(-static_cast<uint32_t>(v) >> F)
+                 : v >> F;
+  }
+  constexpr int32_t round() const {
+    return v < 0
+               ? -static_cast<int32_t>((-static_cast<uint32_t>(v) + HALF) >> F)
+               : static_cast<int32_t>((static_cast<uint32_t>(v) + HALF) >> F);
+  }
+  float toFloat() const { return static_cast<float>(v) / (1L << F); }
+
+  // переполнение суммы видно по знаку, без int64_t
+  Fixed operator+(Fixed b) const {
+    int32_t r = static_cast<uint32_t>(v) + static_cast<uint32_t>(b.v);
+    if (((v ^ r) & (b.v ^ r)) < 0) {
+      r = v < 0 ? FIXED_MIN : FIXED_MAX;
+    }
+    return raw(r);
+  }
+  Fixed operator-(Fixed b) const {
+    int32_t r = static_cast<uint32_t>(v) - static_cast<uint32_t>(b.v);
+    if (((v ^ b.v) & (v ^ r)) < 0) {
+      r = v < 0 ? FIXED_MIN : FIXED_MAX;
+    }
+    return raw(r);
+  }
+  Fixed operator-() const { return raw(v == FIXED_MIN ? FIXED_MAX : -v); }
+  Fixed operator*(Fixed b) const {
+    if (shortProduct(v, b.v)) {
+      return raw((v * b.v) >> F);
+    }
+    return raw(clamp((static_cast<int64_t>(v) * b.v) >> F));
+  }
+  Fixed operator/(Fixed b) const {
+    if (b.v == 0) {
+      return raw(v < 0 ? FIXED_MIN : FIXED_MAX);
+    }
+    if (below(v, 31 - F)) {
+      return raw(v * (1L << F) / b.v);
+    }
+    return raw(clamp(static_cast<int64_t>(v) * (1LL << F) / b.v));
+  }
+  Fixed operator*(int32_t i) const {
+    if (shortProduct(v, i)) {
+      return raw(v * i);
+    }
+    return raw(clamp(static_cast<int64_t>(v) * i));
+  }
+  Fixed operator/(int32_t i) const {
+    if (i == 0) {
+      return raw(v < 0 ? FIXED_MIN : FIXED_MAX);
+    }
+    return raw(v / i);
+  }
+  Fixed abs() const { return v < 0 ? -*this : *this; }
+
+  bool operator<(Fixed b) const { return v < b.v; }
+  bool operator>(Fixed b) const { return v > b.v; }
+  bool operator<=(Fixed b) const { return v <= b.v; }
+  bool operator>=(Fixed b) const { return v >= b.v; }
+  bool operator==(Fixed b) const { return v == b.v; }
+  bool operator!=(Fixed b) const { return v != b.v; }
+
+private:
+  constexpr Fixed(int32_t r, int) : v(r) {}
+};
+
+#endif
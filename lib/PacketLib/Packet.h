@@ -3,7 +3,13 @@
 
 #include <inttypes.h>
 
-#define PACKET_SIZE 5
+// Кадр: SYNC | ADDR | ID | LEN | PAYLOAD[LEN] | CRC16(lo, hi)
+// CRC-16/CCITT-FALSE считается по ADDR, ID, LEN и PAYLOAD
+#define PACKET_SYNC 0xA5
+#define PACKET_HEADER_SIZE 4
+#define PACKET_CRC_SIZE 2
+#define PACKET_PAYLOAD_SIZE 128 //вмещает образ настроек Data
+#define PACKET_SIZE (PACKET_HEADER_SIZE + PACKET_PAYLOAD_SIZE + PACKET_CRC_SIZE)
 
 typedef union {
   uint16_t i;
@@ -14,22 +20,41 @@ class Packet {
 private:
   uint8_t i[PACKET_SIZE];
   uint8_t size = 0;
+  uint8_t address = 0;
   uint8_t id = 0;
+  uint8_t length = 0;
   uint16_t val = 0;
-  uint16_t control = 0;
-  uint16_t getControl();
+  bool ready = false;
+  uint16_t errors = 0;
+  uint8_t frameLength();
+  bool parse();
+  void shift(uint8_t n);
+  void consume();
 public:
+  static uint16_t crc(const uint8_t *data, uint8_t len,
+                      uint16_t c = 0xFFFF);
   Packet();
   bool avaible();
   void init(uint8_t id, uint16_t val);
-  void write(uint8_t byte);
+  void init(uint8_t id, const uint8_t *payload, uint8_t len);
+  void init(uint8_t id, uint8_t len);
+  uint8_t *getBuffer();
+  bool write(uint8_t byte);
+  bool next();
   void unpack();
   void fill();
   bool isValid();
   void send();
   void clear();
+  void setAddress(uint8_t address);
+  uint8_t getAddress();
   uint8_t getId();
   uint16_t getVal();
+  uint8_t getLength();
+  const uint8_t *getPayload();
+  const uint8_t *getFrame();
+  uint8_t getFrameLength();
+  uint16_t getErrors();
 };
 
 #endif
@@ -0,0 +1,132 @@
+#ifndef Protocol_h
+#define Protocol_h
+
+// ADDR: адрес узла на шине, старший бит - ответ узла ведущему.
+// Узел с адресом ADDRESS_NONE работает точка-точка и отвечает на всё,
+// на широковещательные команды узлы не отвечают
+#define ADDRESS_NONE 0x00
+#define ADDRESS_BROADCAST 0x7F
+#define ADDRESS_REPLY 0x80
+#define ADDRESS_MASK 0x7F
+
+// Идентификаторы пакетов. Регистр читается пакетом с его ID без данных
+// и пишется пакетом со значением uint16; в ответ приходит текущее значение
+enum PacketType {
+  PACKET_TELEMETRY = 0x01,   //запрос: пусто или [TELEMETRY_KEY]
+  PACKET_NACK = 0x02,        //[id, NackCode]
+  PACKET_BLOCK_READ = 0x03,  //ответ - образ настроек Data
+  PACKET_BLOCK_WRITE = 0x04, //образ настроек Data, ответ PACKET_BLOCK_WRITE
+  PACKET_SAVE = 0x05,        //немедленная запись настроек в EEPROM
+  PACKET_EVENTS = 0x06,      //запрос: пусто или [1] - копия из EEPROM
+  PACKET_REGISTER = 0x20
+};
+
+enum Register {
+  REG_PUMP_SPEED = PACKET_REGISTER, //x100 L/h
+  REG_PUMP_COEFF,                   //x100
+  REG_TSA,                          //x10 C
+  REG_NBK_BARD,                     //x10 C
+  REG_NBK_OUTPUT,                   //x10 C
+  REG_NBK_DELTA,                    //x10 C
+  REG_NBK_WATT,
+  REG_NBK_TO_MYSELF,                //min
+  REG_RECT_CUBE_TAIL,               //x10 C
+  REG_RECT_CUBE_END,                //x10 C
+  REG_RECT_OUTPUT,                  //x10 C
+  REG_RECT_DELTA,                   //x10 C
+  REG_RECT_DELTA_TAIL,              //x10 C
+  REG_RECT_WATT,
+  REG_RECT_SPEED_HEAD,              //ml/h
+  REG_RECT_SPEED_BODY,              //ml/h
+  REG_RECT_SPEED_REDUCTION,         //%
+  REG_RECT_TO_MYSELF,               //min
+  REG_RECT_TRIM_KP,                 //% на 0.1 C
+  REG_RECT_TRIM_KD,                 //% на 0.1 C/min
+  REG_RECT_SETTLE,                  //x100 C/min
+  REG_NODE_ADDRESS,
+  REG_TENG_ONE_WATT,
+  REG_TENG_TWO_WATT,
+  REG_HEATER_WINDOW,                //ms
+  REG_NBK_PUMP_MIN,                 //x100 L/h
+  REG_NBK_PUMP_MAX,                 //x100 L/h
+  REG_NBK_KP,                       //x100 L/h на C
+  REG_NBK_KI,                       //x1000 L/h на C*s
+  REG_NBK_FEED_FF,                  //x100 L/h на kW
+  REG_NBK_FEED_RATE,                //x1000 L/h за секунду
+  REG_NBK_MAXIMIZE,
+  REG_NBK_BACKOFF,                  //%
+  REG_NBK_PROBE_STEP,               //x100 L/h
+  REG_NBK_SAG,                      //x100 C/min
+  REG_STAB_BAND,                    //x100 C
+  REG_STAB_SLOPE,                   //x100 C/min
+  REG_STAB_WINDOW,                  //min, 0 - только по времени
+  REG_STAB_MIN,                     //min
+  REG_NBK_MASH,                     //L браги на начало запуска
+  REG_RECT_ABV_TAIL,                //%об в кубе, 0 - по температуре
+  REG_RECT_ABV_END,                 //%об в кубе, 0 - по температуре
+  REG_PRESSURE,                     //мм рт. ст., 0 - без поправки
+  REG_DATA_END,
+
+  REG_STATUS = REG_DATA_END,
+  REG_MODE,
+  REG_REAL_SPEED_BODY,              //ml/h
+  REG_PUMP_MANUAL,
+  REG_PUMP_PWM,
+  REG_FEED_MAX,                     //x100 L/h для текущей nbk_watt
+  REG_BODY_TRIM,                    //% снижения отбора тела
+  REG_OVERCLOCK_TIME,               //с последнего разгона в текущем режиме
+  REG_OVERCLOCK_LEAD,               //с упреждения снижения мощности
+  REG_INTERLOCK_REACTION,           //мс от измерения ТСА до отключения тэнов
+  REG_LOOP_MAX,                     //мс, самый долгий проход loop
+  REG_ENERGY,                       //Вт*ч с начала запуска, запись сбрасывает
+  REG_ENERGY_PER_LITER,             //Вт*ч на литр браги (НБК) или отбора
+  REG_PRODUCT,                      //мл отбора с начала запуска
+  REG_ETA,                          //мин до конца запуска, 0xFFFF - неизвестно
+  REG_CUBE_ABV,                     //x10 %об жидкости в кубе, 9990 - ошибка
+  REG_OUTPUT_ABV,                   //x10 %об пара на выходе, 9990 - ошибка
+  REG_END
+};
+
+enum Status {
+  OFF,
+  OVERCLOCK,
+  STABILIZATION,
+  HEAD,
+  BODY,
+  PROCESS,
+  TAIL,
+  END,
+  MANUAL,
+  ERROR_TSA,
+  ERROR_BARD,
+  STATUS_COUNT
+};
+enum Mode { NBK_MODE, RECT_MODE, MODE_COUNT };
+
+// Событие журнала: время 24 бита (мс от включения / 1024, около 198 суток,
+// младший байт первым), код, два байта данных.
+// Ответ PACKET_EVENTS: время сейчас (EVENT_TIME_SIZE) и события от старых к
+// новым
+#define EVENT_TIME_SIZE 3
+#define EVENT_SIZE (EVENT_TIME_SIZE + 3)
+enum EventCode {
+  EVENT_BOOT,      //a - MCUSR
+  EVENT_STATUS,    //a - был, b - стал
+  EVENT_MODE,      //a - прежний режим
+  EVENT_RULE,      //a - номер правила защиты, b - этап после
+  EVENT_INTERLOCK, //мс реакции
+  EVENT_SENSOR,    //a - номер датчика
+  EVENT_PAUSE,     //ml/h отбора тела после снижения
+  EVENT_RESUME,    //с паузы
+  EVENT_TRIM,      //a - % снижения отбора
+  EVENT_FEED,      //x100 L/h, ручное изменение подачи
+  EVENT_FEED_MAX,  //x100 L/h, найденная подача
+  EVENT_SAVE,
+  EVENT_MIGRATE,   //a - версия перенесённых настроек
+  EVENT_WATCHDOG,  //loop ожил после отключения тэнов сторожевым таймером
+  EVENT_COUNT
+};
+
+enum NackCode { NACK_UNKNOWN, NACK_LENGTH, NACK_RANGE, NACK_VERSION };
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef Pin_h
+#define Pin_h
+
+#include <avr/io.h>
+#include <inttypes.h>
+
+// Вывод ATmega328 с номером Arduino, известным при компиляции: 0-7 порт D,
+// 8-13 порт B, 14-19 (A0-A5) порт C. Адрес порта и маска постоянные, так что
+// high/low собираются в одну sbi/cbi без поиска порта по номеру
+template <uint8_t P> class Pin {
+  static_assert(P < 20, "Pin must be 0..19");
+
+public:
+  static constexpr uint8_t mask() {
+    return 1 << (P < 8 ? P : P < 14 ? P - 8 : P - 14);
+  }
+  static volatile uint8_t &port() {
+    return P < 8 ? PORTD : P < 14 ? PORTB : PORTC;
+  }
+  static volatile uint8_t &ddr() { return P < 8 ? DDRD : P < 14 ? DDRB : DDRC; }
+  static volatile uint8_t &pin() { return P < 8 ? PIND : P < 14 ? PINB : PINC; }
+
+  static void output() { ddr() |= mask(); }
+  static void input(bool pullup = false) {
+    ddr() &= ~mask();
+    write(pullup);
+  }
+  static void high() { port() |= mask(); }
+  static void low() { port() &= ~mask(); }
+  static void write(bool v) {
+    if (v) {
+      high();
+    } else {
+      low();
+    }
+  }
+  static bool read() { return pin() & mask(); }
+};
+
+#endif
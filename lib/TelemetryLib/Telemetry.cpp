@@ -0,0 +1,145 @@
+#include "Telemetry.h"
+
+// максимальная длина varint для 32 бит
+#define VARINT_SIZE 5
+
+static uint32_t zigzag(int32_t v) {
+  return (static_cast<uint32_t>(v) << 1) ^ static_cast<uint32_t>(v >> 31);
+}
+
+static int32_t unzigzag(uint32_t v) {
+  return static_cast<int32_t>(v >> 1) ^ -static_cast<int32_t>(v & 1);
+}
+
+uint8_t Telemetry::putVarint(uint8_t *out, uint32_t v) {
+  uint8_t n = 0;
+  while (v > 0x7F) {
+    out[n++] = (v & 0x7F) | 0x80;
+    v >>= 7;
+  }
+  out[n++] = v;
+  return n;
+}
+
+uint8_t Telemetry::getVarint(const uint8_t *in, uint8_t len, uint32_t &v) {
+  v = 0;
+  for (uint8_t n = 0; n < len && n < VARINT_SIZE; n++) {
+    v |= static_cast<uint32_t>(in[n] & 0x7F) << (7 * n);
+    if (!(in[n] & 0x80)) {
+      return n + 1;
+    }
+  }
+  return 0;
+}
+
+Telemetry::Telemetry() {
+  for (uint8_t x = 0; x < TELEMETRY_FIELDS; x++) {
+    rate[x] = 1;
+  }
+  reset();
+}
+
+void Telemetry::reset() {
+  for (uint8_t x = 0; x < TELEMETRY_FIELDS; x++) {
+    last[x] = 0;
+  }
+  seq = 0;
+  synced = false;
+}
+
+void Telemetry::setRate(uint8_t field, uint8_t period) {
+  if (field < TELEMETRY_FIELDS) {
+    rate[field] = period;
+  }
+}
+
+uint8_t Telemetry::getRate(uint8_t field) {
+  return field < TELEMETRY_FIELDS ? rate[field] : 0;
+}
+
+void Telemetry::setKeyPeriod(uint8_t period) { key_period = period; }
+
+// Возвращает длину payload или 0, если не хватило места
+uint8_t Telemetry::encode(const int32_t *values, uint8_t *out, uint8_t size) {
+  if (size < 2 + VARINT_SIZE) {
+    return 0;
+  }
+  bool key = !synced || key_period == 0 || seq % key_period == 0;
+  uint32_t mask = 0;
+  for (uint8_t x = 0; x < TELEMETRY_FIELDS; x++) {
+    if (key) {
+      mask |= 1UL << x;
+    } else if (rate[x] != 0 && seq % rate[x] == 0 && values[x] != last[x]) {
+      mask |= 1UL << x;
+    }
+  }
+  out[0] = seq;
+  out[1] = key ? TELEMETRY_KEY : 0;
+  uint8_t n = 2 + putVarint(out + 2, mask);
+  for (uint8_t x = 0; x < TELEMETRY_FIELDS; x++) {
+    if (!(mask & (1UL << x))) {
+      continue;
+    }
+    if (n + VARINT_SIZE > size) {
+      return 0;
+    }
+    int32_t v = key ? values[x] : values[x] - last[x];
+    n += putVarint(out + n, zigzag(v));
+  }
+  // last меняется только для кадра, который уйдёт целиком
+  for (uint8_t x = 0; x < TELEMETRY_FIELDS; x++) {
+    if (mask & (1UL << x)) {
+      last[x] = values[x];
+    }
+  }
+  seq++;
+  synced = true;
+  return n;
+}
+
+// Кадр с пропущенным номером не применяется до следующего ключевого
+bool Telemetry::decode(const uint8_t *in, uint8_t len) {
+  if (len < 3) {
+    return false;
+  }
+  bool key = in[1] & TELEMETRY_KEY;
+  if (!key && (!synced || in[0] != static_cast<uint8_t>(seq + 1))) {
+    synced = false;
+    return false;
+  }
+  uint32_t mask;
+  uint8_t n = 2;
+  uint8_t r = getVarint(in + n, len - n, mask);
+  if (r == 0) {
+    synced = false;
+    return false;
+  }
+  n += r;
+  int32_t values[TELEMETRY_FIELDS];
+  for (uint8_t x = 0; x < TELEMETRY_FIELDS; x++) {
+    values[x] = last[x];
+    if (!(mask & (1UL << x))) {
+      continue;
+    }
+    uint32_t v;
+    r = getVarint(in + n, len - n, v);
+    if (r == 0) {
+      synced = false;
+      return false;
+    }
+    n += r;
+    values[x] = key ? unzigzag(v) : last[x] + unzigzag(v);
+  }
+  for (uint8_t x = 0; x < TELEMETRY_FIELDS; x++) {
+    last[x] = values[x];
+  }
+  seq = in[0];
+  synced = true;
+  return true;
+}
+
+bool Telemetry::isSynced() { return synced; }
+
+int32_t Telemetry::get(uint8_t field) {
+  return field < TELEMETRY_FIELDS ? last[field] : 0;
+}
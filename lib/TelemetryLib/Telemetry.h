@@ -0,0 +1,52 @@
+#ifndef Telemetry_h
+#define Telemetry_h
+
+#include <inttypes.h>
+
+// Payload: SEQ | FLAGS | MASK(varint) | VALUE(zigzag varint)...
+// В ключевом кадре значения абсолютные, в остальных - разница с
+// предыдущим переданным значением. Поля без изменений не передаются
+#define TELEMETRY_KEY 0x01
+#define TELEMETRY_KEY_PERIOD 30
+
+enum TelemetryField {
+  TM_BARD_TEMP,      //x10 C
+  TM_OUTPUT_TEMP,    //x10 C
+  TM_TSA_TEMP,       //x10 C
+  TM_PUMP_SPEED,     //x100 L/h, уставка
+  TM_REAL_PUMP_SPEED, //x100 L/h
+  TM_PUMP_PWM,
+  TM_LITERS,         //x10 L
+  TM_STATUS,
+  TM_MODE,
+  TM_VALVE_OPEN_TIME, //ms
+  TM_REAL_SPEED_BODY, //ml/h
+  TM_POWER,          //W
+  TM_ENERGY,         //Wh, по времени включения тэнов
+  TM_PRODUCT,        //ml отбора
+  TM_ETA,            //s до конца запуска, -1 - неизвестно
+  TELEMETRY_FIELDS
+};
+
+class Telemetry {
+private:
+  int32_t last[TELEMETRY_FIELDS];
+  uint8_t rate[TELEMETRY_FIELDS];
+  uint8_t seq = 0;
+  uint8_t key_period = TELEMETRY_KEY_PERIOD;
+  bool synced = false;
+public:
+  static uint8_t putVarint(uint8_t *out, uint32_t v);
+  static uint8_t getVarint(const uint8_t *in, uint8_t len, uint32_t &v);
+  Telemetry();
+  void reset();
+  void setRate(uint8_t field, uint8_t period);
+  uint8_t getRate(uint8_t field);
+  void setKeyPeriod(uint8_t period);
+  uint8_t encode(const int32_t *values, uint8_t *out, uint8_t size);
+  bool decode(const uint8_t *in, uint8_t len);
+  bool isSynced();
+  int32_t get(uint8_t field);
+};
+
+#endif
@@ -0,0 +1,42 @@
+#include "Time.h"
+#include <stdio.h>
+
+static uint32_t last = 0;
+static uint16_t wraps = 0;
+
+// Запрет прерываний делает продолжение согласованным, если uptime()
+// вызывается и из обработчика прерывания
+static uint32_t sample(uint16_t &w) {
+  uint8_t s = SREG;
+  cli();
+  uint32_t now = millis();
+  if (now < last) {
+    wraps++;
+  }
+  last = now;
+  w = wraps;
+  SREG = s;
+  return now;
+}
+
+uint64_t uptime() {
+  uint16_t w;
+  uint32_t now = sample(w);
+  return static_cast<uint64_t>(w) << 32 | now;
+}
+
+uint32_t uptimeTicks() {
+  uint16_t w;
+  uint32_t now = sample(w);
+  return static_cast<uint32_t>(w) << 22 | now >> 10;
+}
+
+uint32_t uptimeSeconds() { return uptime() / 1000; }
+
+char *formatTime(char *buf, uint8_t size, uint32_t seconds) {
+  snprintf(buf, size, "%02lu:%02lu:%02lu",
+           static_cast<unsigned long>(seconds / 3600),
+           static_cast<unsigned long>(seconds / 60 % 60),
+           static_cast<unsigned long>(seconds % 60));
+  return buf;
+}
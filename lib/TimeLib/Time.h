@@ -0,0 +1,82 @@
+#ifndef Time_h
+#define Time_h
+
+#include <Arduino.h>
+#include <inttypes.h>
+
+// Время от включения и сроки без сбоя на переполнении millis() (49.7 суток).
+// uptime() продолжает millis() старшими битами; вызывать не реже раза в
+// 49 суток (loop вызывает на каждом проходе). Deadline хранит 32-битную
+// отметку и сравнивает по разности, поэтому верен через переполнение для
+// сроков короче 24 суток. Elapsed отсчитывает от uptime() и не сбрасывается
+// через 49.7 суток, а упирается в 0xFFFFFFFF мс
+uint64_t uptime();
+uint32_t uptimeSeconds();
+// uptime() / 1024 без 64-битной арифметики
+uint32_t uptimeTicks();
+
+#define TIME_STRING_SIZE 9 //ЧЧ:ММ:СС с нулём, до 99 ч
+
+// ЧЧ:ММ:СС в buf; с коротким буфером (size 6) остаётся ЧЧ:ММ
+char *formatTime(char *buf, uint8_t size, uint32_t seconds);
+
+// Неподвешенный срок считается истёкшим
+class Deadline {
+private:
+  uint32_t at = 0;
+  bool armed = false;
+
+public:
+  void start(uint32_t ms) {
+    at = millis() + ms;
+    armed = true;
+  }
+  void stop() { armed = false; }
+  bool isArmed() const { return armed; }
+  bool expired() const {
+    return !armed || static_cast<int32_t>(millis() - at) >= 0;
+  }
+  // для периодических задач: истёк - запускается на period заново
+  bool tick(uint32_t period) {
+    if (!expired()) {
+      return false;
+    }
+    start(period);
+    return true;
+  }
+  uint32_t left() const { return expired() ? 0 : at - millis(); }
+};
+
+// Секундомер: после stop() get() держит набранное время
+class Elapsed {
+private:
+  uint64_t since = 0;
+  uint32_t total = 0;
+  uint8_t state = 0; //0 - не запускался, 1 - идёт, 2 - остановлен
+
+  uint32_t measure() const {
+    uint64_t d = uptime() - since;
+    return d > 0xFFFFFFFFUL ? 0xFFFFFFFFUL : static_cast<uint32_t>(d);
+  }
+
+public:
+  void start() {
+    since = uptime();
+    state = 1;
+  }
+  void stop() {
+    if (state == 1) {
+      total = measure();
+      state = 2;
+    }
+  }
+  void reset() {
+    total = 0;
+    state = 0;
+  }
+  bool isRunning() const { return state == 1; }
+  bool isStarted() const { return state != 0; }
+  uint32_t get() const { return state == 1 ? measure() : total; }
+};
+
+#endif
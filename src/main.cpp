@@ -1,8 +1,16 @@
 #include <Arduino.h>
 #include <EEPROM.h>
+#include <avr/wdt.h>
+#include <util/atomic.h>
 #include <LiquidCrystal_I2C.h>
 #include <OneWire.h>
 #include <DallasTemperature.h>
+#include <Fixed.h>
+#include <Pin.h>
+#include <Packet.h>
+#include <Protocol.h>
+#include <Telemetry.h>
+#include <Time.h>
 
 LiquidCrystal_I2C lcd(0x27, 16, 2);
 
@@ -11,6 +19,7 @@ LiquidCrystal_I2C lcd(0x27, 16, 2);
 #define SELECTION_VALVE_PIN 10
 #define TENG_ONE_PIN 11
 #define TENG_TWO_PIN 13
+#define HEATER_MIN_PULSE 100 //минимальное время включения тэна мс
 #define BUZZER_PIN A2
 #define COOLER_PIN 12
 #define TEMPERATURE_PIN 2
@@ -24,7 +33,41 @@ LiquidCrystal_I2C lcd(0x27, 16, 2);
 #define SELECTION_VALVE_STEP 100 //шаг уменьшения(увеличения) отбора в мс
 #define SELECTION_VALVE_OPEN_TIME 60 //время на открытие клапана мс
 #define ERR "err"
-#define RECT_DELTA_PAUSE 180000
+#define RECT_PAUSE_MIN 30000 //минимальная пауза отбора мс
+#define RECT_TRIM_MAX 50 //наибольшее снижение отбора без паузы, %
+#define SERIAL_SPEED 9600
+// Сборка под один режим: -DWITH_NBK=0 убирает регулятор подачи НБК,
+// -DWITH_RECT=0 - клапан отбора и оценку крепости ректификации
+#ifndef WITH_NBK
+#define WITH_NBK 1
+#endif
+#ifndef WITH_RECT
+#define WITH_RECT 1
+#endif
+static_assert(WITH_NBK || WITH_RECT, "at least one mode must be built");
+#define RS485_PIN A3 //управление передатчиком RS-485
+#define TELEMETRY_TIME 1000 //период отправки телеметрии мс
+#define EVENT_LOG_SIZE 16 //степень двойки
+#define EVENT_LOG_ADDRESS 600 //копия журнала событий при тревоге
+#define EVENT_LOG_MARK 0x80 //копия по слотам с 24-битным временем
+#define EVENT_MIRROR_TIME 100 //мс между записями слотов копии
+#define BUTTON_COUNT 5
+#define KEYBOARD_SAMPLE 1 //мс между опросами нажатых или дребезжащих кнопок
+#define KEYBOARD_DEBOUNCE 4 //опросов подряд для смены состояния кнопки
+#define KEYBOARD_QUEUE 4 //степень двойки
+#define INTERLOCK_HOLD 2 //измерений ТСА выше порога до отключения тэнов
+#define ETA_UNKNOWN 0xFFFFFFFFUL
+#define ETA_VOLUME_STEP 50 //мл отбора между замерами подъёма куба
+#define FEED_PROBE_TIME 120 //с между шагами поиска подачи
+#define FEED_SAG_TIME 10 //с остывания до отката подачи
+#define FEED_LOG_ADDRESS 512 //найденные подачи в EEPROM
+#define FEED_LOG_SIZE 8
+#define OVERCLOCK_LOG_ADDRESS 560 //время разгона и упреждение по режимам
+#define OVERCLOCK_LEAD 90 //с, начальное упреждение снижения мощности
+#define OVERCLOCK_LEAD_STEP 15 //с
+#define OVERCLOCK_LEAD_MAX 900 //с
+#define OVERCLOCK_OVERSHOOT 0.5 //допустимый заброс выхода C
+#define OVERCLOCK_WATCH 300 //с наблюдения за забросом после разгона
 
 OneWire oneWire(TEMPERATURE_PIN);
 DallasTemperature sensors(&oneWire);
@@ -32,8 +75,14 @@ DeviceAddress nbk_bard = {0x28, 0xFF, 0xE2, 0xFC, 0x80, 0x14, 0x02, 0x7B};
 DeviceAddress nbk_output = {0x28, 0xFF, 0x1F, 0x11, 0x25, 0x17, 0x03, 0x2D};
 DeviceAddress tsa = {0x28, 0xFF, 0x44, 0x05, 0xC4, 0x17, 0x04, 0x11};
 DeviceAddress *DEVICE_ADDRESS[3];
-uint8_t keyboard_pins[] = {7, 4, 6, 5, 8};
+uint8_t keyboard_pins[BUTTON_COUNT] = {7, 4, 6, 5, 8};
 unsigned long tick[PUMP_CONTROL_SECOND];
+typedef Fixed<8> Q8; //регулирование насоса, L/h
+// ПИ-регулятор подачи, L/h: шаг интеграла за секунду меньше 1/256 L/h
+typedef Fixed<16> Q16;
+typedef Pin<MOSFET_PIN> MosfetPin;
+typedef Pin<RS485_PIN> Rs485Pin;
+static_assert(MOSFET_PIN == 9, "pump PWM is bound to OC1A");
 
 enum BuzzerType {
   BUZZER_INFO,
@@ -47,7 +96,7 @@ public:
 private:
   bool enabled = false;
   BuzzerType select_type = BUZZER_NONE;
-  unsigned long next = 0;
+  Deadline next;
   byte b = 0;
 
   void to(BuzzerType t) {
@@ -56,21 +105,21 @@ private:
       tone(BUZZER_PIN, 2000, 2000);
       break;
     case BUZZER_ERROR:
-      if (next < millis()) {
+      if (next.expired()) {
         tone(BUZZER_PIN, 2200, 300);
         if (b < 3) {
-          next = millis() + 400;
+          next.start(400);
           b++;
         } else {
-          next = millis() + 1000;
+          next.start(1000);
           b = 0;
         }
       }
       break;
     case BUZZER_END:
-      if (next < millis()) {
+      if (next.expired()) {
         tone(BUZZER_PIN, 2000, 1000);
-        next = millis() + 2000;
+        next.start(2000);
       }
       break;
     case BUZZER_BUTTON:
@@ -104,8 +153,215 @@ void copy(DeviceAddress from, DeviceAddress to) {
     to[i] = from[i];
   }
 }
-uint8_t dataVersion = 143;
+uint8_t dataVersion = 152;
+#define DATA_NBK_MAXIMIZE 0 //бит flags: поиск максимальной подачи в PROCESS
+// Настройки хранятся целыми в масштабе своего регистра
 struct Data {
+  uint8_t version;
+  int16_t pump_speed; //x100 L/h
+  int16_t pump_coeff; //x100
+  int16_t tsa;        //x10 C
+  int16_t nbk_bard;   //x10 C
+  int16_t nbk_output; //x10 C
+  int16_t nbk_delta;  //x10 C
+  uint16_t nbk_watt;
+  uint8_t nbk_to_myself;
+  int16_t rect_cube_tail;  //x10 C
+  int16_t rect_cube_end;   //x10 C
+  int16_t rect_output;     //x10 C
+  int16_t rect_delta;      //x10 C
+  int16_t rect_delta_tail; //x10 C
+  uint16_t rect_watt;
+  uint16_t rect_speed_head;
+  uint16_t rect_speed_body;
+  uint8_t rect_speed_reduction;
+  uint8_t rect_to_myself;
+  uint8_t rect_trim_kp; //снижение отбора % на 0.1 C подъёма выхода
+  uint8_t rect_trim_kd; //снижение отбора % на 0.1 C/min
+  uint8_t rect_settle;  //x100 C/min, колонна успокоилась
+  uint8_t node_address;
+  uint16_t teng_one_watt;
+  uint16_t teng_two_watt;
+  uint16_t heater_window; //окно регулирования мощности мс
+  int16_t nbk_pump_min;   //x100 L/h
+  int16_t nbk_pump_max;   //x100 L/h
+  int16_t nbk_kp;         //x100 L/h на C
+  int16_t nbk_ki;         //x1000 L/h на C*s
+  int16_t nbk_feed_ff;    //x100 L/h на kW мощности нагрева
+  int16_t nbk_feed_rate;  //x1000, максимальное изменение подачи L/h за секунду
+  uint8_t flags;          //биты DATA_*
+  uint8_t nbk_backoff;    //откат от найденной подачи, %
+  int16_t nbk_probe_step; //x100, шаг поиска подачи L/h
+  int16_t nbk_sag;        //x100, скорость остывания C/min, считающаяся провалом
+  uint8_t stab_band;   //x100 C, полоса устойчивости выхода и куба
+  uint8_t stab_slope;  //x100 C/min
+  uint8_t stab_window; //мин устойчивости до конца стабилизации, 0 - по времени
+  uint8_t stab_min;    //мин, стабилизация не короче
+  uint16_t nbk_mash;   //L браги на начало запуска, 0 - не задано
+  uint8_t rect_abv_tail; //%об в кубе для перехода на хвосты, 0 - по температуре
+  uint8_t rect_abv_end;  //%об в кубе для окончания, 0 - по температуре
+  uint16_t pressure;     //мм рт. ст., 0 - без поправки
+  DeviceAddress tsa_addr;
+  DeviceAddress bard_addr;
+  DeviceAddress output_addr;
+};
+Data data = {};
+// Схема настроек: где лежит регистр, его вид, диапазон и значение по
+// умолчанию. По ней заполняются значения по умолчанию, проверяются записи
+// с компьютера и переносятся настройки прошлых версий
+enum RegisterType {
+  REG_INT16,
+  REG_UINT8,
+  REG_UINT16,
+  REG_BIT //бит flags, номер бита в min
+};
+struct RegisterInfo {
+  uint8_t offset;
+  uint8_t type;
+  uint16_t min;
+  uint16_t max;
+  uint16_t def;
+};
+#define REG_FLAG(field, bit)                                                   \
+  { offsetof(Data, field), REG_BIT, bit, 1, 0 }
+constexpr RegisterInfo REGISTERS[] PROGMEM = {
+    {offsetof(Data, pump_speed), REG_INT16, 0, 5000, 1550},
+    {offsetof(Data, pump_coeff), REG_INT16, 10, 1000, 195},
+    {offsetof(Data, tsa), REG_INT16, 0, 1000, 420},
+    {offsetof(Data, nbk_bard), REG_INT16, 500, 1100, 987},
+    {offsetof(Data, nbk_output), REG_INT16, 300, 1100, 902},
+    {offsetof(Data, nbk_delta), REG_INT16, 0, 100, 3},
+    {offsetof(Data, nbk_watt), REG_UINT16, 0, 10000, 3000},
+    {offsetof(Data, nbk_to_myself), REG_UINT8, 0, 255, 5},
+    {offsetof(Data, rect_cube_tail), REG_INT16, 500, 1100, 910},
+    {offsetof(Data, rect_cube_end), REG_INT16, 500, 1100, 960},
+    {offsetof(Data, rect_output), REG_INT16, 200, 1100, 450},
+    {offsetof(Data, rect_delta), REG_INT16, 0, 100, 3},
+    {offsetof(Data, rect_delta_tail), REG_INT16, 0, 100, 5},
+    {offsetof(Data, rect_watt), REG_UINT16, 0, 10000, 2800},
+    {offsetof(Data, rect_speed_head), REG_UINT16, 0, SELECTION_VALVE_COEFF,
+     150},
+    {offsetof(Data, rect_speed_body), REG_UINT16, 0, SELECTION_VALVE_COEFF,
+     2100},
+    {offsetof(Data, rect_speed_reduction), REG_UINT8, 0, 100, 10},
+    {offsetof(Data, rect_to_myself), REG_UINT8, 0, 255, 60},
+    {offsetof(Data, rect_trim_kp), REG_UINT8, 0, 100, 10},
+    {offsetof(Data, rect_trim_kd), REG_UINT8, 0, 100, 5},
+    {offsetof(Data, rect_settle), REG_UINT8, 1, 255, 5},
+    {offsetof(Data, node_address), REG_UINT8, ADDRESS_NONE,
+     ADDRESS_BROADCAST - 1, ADDRESS_NONE},
+    {offsetof(Data, teng_one_watt), REG_UINT16, 0, 10000, 1500},
+    {offsetof(Data, teng_two_watt), REG_UINT16, 0, 10000, 1500},
+    {offsetof(Data, heater_window), REG_UINT16, 500, 60000, 2000},
+    {offsetof(Data, nbk_pump_min), REG_INT16, 0, 5000, 1000},
+    {offsetof(Data, nbk_pump_max), REG_INT16, 0, 5000, 3000},
+    {offsetof(Data, nbk_kp), REG_INT16, 0, 10000, 200},
+    {offsetof(Data, nbk_ki), REG_INT16, 0, 10000, 20},
+    {offsetof(Data, nbk_feed_ff), REG_INT16, 0, 5000, 500},
+    {offsetof(Data, nbk_feed_rate), REG_INT16, 1, 10000, 50},
+    REG_FLAG(flags, DATA_NBK_MAXIMIZE),
+    {offsetof(Data, nbk_backoff), REG_UINT8, 0, 50, 5},
+    {offsetof(Data, nbk_probe_step), REG_INT16, 1, 500, 50},
+    {offsetof(Data, nbk_sag), REG_INT16, 1, 1000, 30},
+    {offsetof(Data, stab_band), REG_UINT8, 1, 255, 10},
+    {offsetof(Data, stab_slope), REG_UINT8, 1, 255, 5},
+    {offsetof(Data, stab_window), REG_UINT8, 0, 255, 0},
+    {offsetof(Data, stab_min), REG_UINT8, 0, 255, 2},
+    {offsetof(Data, nbk_mash), REG_UINT16, 0, 5000, 0},
+    {offsetof(Data, rect_abv_tail), REG_UINT8, 0, 96, 0},
+    {offsetof(Data, rect_abv_end), REG_UINT8, 0, 96, 0},
+    {offsetof(Data, pressure), REG_UINT16, 0, 900, 0}};
+#define REGISTER_COUNT (sizeof(REGISTERS) / sizeof(RegisterInfo))
+constexpr bool isRegisterTable(const RegisterInfo *r, uint8_t i) {
+  return i == REGISTER_COUNT ||
+         ((r[i].type == REG_BIT
+               ? r[i].min < 8 && r[i].def <= 1
+               : r[i].min <= r[i].def && r[i].def <= r[i].max &&
+                     (r[i].type != REG_INT16 || r[i].max <= 0x7FFF) &&
+                     (r[i].type != REG_UINT8 || r[i].max <= 0xFF)) &&
+          isRegisterTable(r, i + 1));
+}
+static_assert(REGISTER_COUNT == REG_DATA_END - PACKET_REGISTER &&
+                  isRegisterTable(REGISTERS, 0),
+              "REGISTERS must match Register and hold defaults in range");
+static_assert(sizeof(Data) <= PACKET_PAYLOAD_SIZE,
+              "Data must fit into one packet");
+static_assert(sizeof(Data) <= FEED_LOG_ADDRESS,
+              "Data must not overlap the feed log");
+
+uint16_t getRegister(const Data &d, uint8_t reg) {
+  RegisterInfo r;
+  memcpy_P(&r, &REGISTERS[reg - PACKET_REGISTER], sizeof(RegisterInfo));
+  const uint8_t *v = reinterpret_cast<const uint8_t *>(&d) + r.offset;
+  uint16_t i;
+  switch (r.type) {
+  case REG_INT16:
+  case REG_UINT16:
+    memcpy(&i, v, sizeof(uint16_t));
+    return i;
+  case REG_UINT8:
+    return *v;
+  case REG_BIT:
+    return (*v >> r.min) & 1;
+  default:
+    return 0;
+  }
+}
+
+bool setRegister(Data &d, uint8_t reg, uint16_t val) {
+  RegisterInfo r;
+  memcpy_P(&r, &REGISTERS[reg - PACKET_REGISTER], sizeof(RegisterInfo));
+  uint8_t *v = reinterpret_cast<uint8_t *>(&d) + r.offset;
+  switch (r.type) {
+  case REG_INT16:
+  case REG_UINT16:
+    if (val < r.min || val > r.max) {
+      return false;
+    }
+    memcpy(v, &val, sizeof(uint16_t));
+    return true;
+  case REG_UINT8:
+    if (val < r.min || val > r.max) {
+      return false;
+    }
+    *v = val;
+    return true;
+  case REG_BIT:
+    if (val > 1) {
+      return false;
+    }
+    *v = (*v & ~(1 << r.min)) | (val << r.min);
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool dataFlag(uint8_t bit) { return (data.flags >> bit) & 1; }
+
+// Раскладки прошлых версий. Переносятся только перечисленные поля: значение
+// переводится в масштаб регистра и проходит проверку диапазона, иначе
+// остаётся значение по умолчанию. Версии без раскладки сбрасываются
+enum LegacyType {
+  LEGACY_FLOAT10,
+  LEGACY_FLOAT100,
+  LEGACY_UINT8,
+  LEGACY_UINT16
+};
+struct LegacyField {
+  uint8_t reg;
+  uint8_t offset;
+  uint8_t type;
+};
+struct Legacy {
+  uint8_t version;
+  const LegacyField *fields;
+  uint8_t count;
+  uint8_t addresses; //смещение трёх адресов датчиков подряд
+};
+// 143: выпущенная раскладка, дробные настройки во float. Смещения
+// проверяются по образу EEPROM прошивок 143
+struct DataV143 {
   uint8_t version;
   float pump_speed;
   float pump_coeff;
@@ -126,54 +382,231 @@ struct Data {
   uint8_t rect_speed_reduction;
   uint8_t rect_to_myself;
   DeviceAddress tsa_addr;
-  DeviceAddress bard_addr; 
+  DeviceAddress bard_addr;
   DeviceAddress output_addr;
 };
-Data data = {};
+static_assert(offsetof(DataV143, nbk_watt) == 25 &&
+                  offsetof(DataV143, rect_cube_tail) == 28 &&
+                  offsetof(DataV143, rect_watt) == 48 &&
+                  offsetof(DataV143, tsa_addr) == 56 && sizeof(DataV143) == 80,
+              "DataV143 must match the EEPROM image of version 143");
+#define V143(field, reg, type) {reg, offsetof(DataV143, field), type}
+const LegacyField LEGACY_143[] PROGMEM = {
+    V143(pump_speed, REG_PUMP_SPEED, LEGACY_FLOAT100),
+    V143(pump_coeff, REG_PUMP_COEFF, LEGACY_FLOAT100),
+    V143(tsa, REG_TSA, LEGACY_FLOAT10),
+    V143(nbk_bard, REG_NBK_BARD, LEGACY_FLOAT10),
+    V143(nbk_output, REG_NBK_OUTPUT, LEGACY_FLOAT10),
+    V143(nbk_delta, REG_NBK_DELTA, LEGACY_FLOAT10),
+    V143(nbk_watt, REG_NBK_WATT, LEGACY_UINT16),
+    V143(nbk_to_myself, REG_NBK_TO_MYSELF, LEGACY_UINT8),
+    V143(rect_cube_tail, REG_RECT_CUBE_TAIL, LEGACY_FLOAT10),
+    V143(rect_cube_end, REG_RECT_CUBE_END, LEGACY_FLOAT10),
+    V143(rect_output, REG_RECT_OUTPUT, LEGACY_FLOAT10),
+    V143(rect_delta, REG_RECT_DELTA, LEGACY_FLOAT10),
+    V143(rect_delta_tail, REG_RECT_DELTA_TAIL, LEGACY_FLOAT10),
+    V143(rect_watt, REG_RECT_WATT, LEGACY_UINT16),
+    V143(rect_speed_head, REG_RECT_SPEED_HEAD, LEGACY_UINT16),
+    V143(rect_speed_body, REG_RECT_SPEED_BODY, LEGACY_UINT16),
+    V143(rect_speed_reduction, REG_RECT_SPEED_REDUCTION, LEGACY_UINT8),
+    V143(rect_to_myself, REG_RECT_TO_MYSELF, LEGACY_UINT8)};
+const Legacy LEGACIES[] PROGMEM = {
+    {143, LEGACY_143, sizeof(LEGACY_143) / sizeof(LegacyField),
+     offsetof(DataV143, tsa_addr)}};
+template <typename T> T dataField(uint8_t offset) {
+  T v;
+  memcpy(&v, reinterpret_cast<const uint8_t *>(&data) + offset, sizeof(T));
+  return v;
+}
+// Журнал последних событий в RAM. Время - uptimeTicks() в 24 битах, его
+// хватает на 198 суток работы, запись годится для любого места управления.
+// При тревоге журнал копируется в EEPROM
+struct Event {
+  uint8_t time[EVENT_TIME_SIZE];
+  uint8_t code;
+  uint8_t a;
+  uint8_t b;
+  uint32_t getTime() const {
+    return static_cast<uint32_t>(time[0]) |
+           static_cast<uint32_t>(time[1]) << 8 |
+           static_cast<uint32_t>(time[2]) << 16;
+  }
+};
+static void putEventTime(uint8_t *out, uint32_t t) {
+  out[0] = t;
+  out[1] = t >> 8;
+  out[2] = t >> 16;
+}
+static_assert(sizeof(Event) == EVENT_SIZE, "Event must match EVENT_SIZE");
+// Коды событий на экране
+const char EVENT_CODES[][3] PROGMEM = {"BT", "ST", "MD", "RL", "IL", "SN",
+                                       "PS", "RS", "TR", "FD", "FM", "SV",
+                                       "MG", "WD"};
+static_assert(sizeof(EVENT_CODES) / sizeof(EVENT_CODES[0]) == EVENT_COUNT,
+              "EVENT_CODES must match EventCode");
+// Событие номер k лежит в слоте k % EVENT_LOG_SIZE и в RAM, и в копии
+// EEPROM: [EVENT_LOG_MARK | число][слот за последним][слоты]. Копия
+// дописывается по одному новому слоту не чаще раза в EVENT_MIRROR_TIME, уже
+// записанные слоты не переписываются
+class EventLog {
+private:
+  Event events[EVENT_LOG_SIZE];
+  uint8_t head = 0;
+  uint16_t total = 0;
+  uint16_t mirrored = 0; //событий, попавших в копию
+  uint8_t stored = 0;    //верных слотов копии
+  bool pending = false;
+  Deadline next_mirror;
+
+  static uint16_t slotAddress(uint8_t slot) {
+    return EVENT_LOG_ADDRESS + 2 + slot * sizeof(Event);
+  }
+
+public:
+  void add(uint8_t code, uint8_t a = 0, uint8_t b = 0) {
+    Event &e = events[head];
+    putEventTime(e.time, uptimeTicks());
+    e.code = code;
+    e.a = a;
+    e.b = b;
+    head = (head + 1) & (EVENT_LOG_SIZE - 1);
+    total++;
+  }
+  void add16(uint8_t code, uint16_t v) { add(code, v & 0xFF, v >> 8); }
+  uint8_t size() { return total < EVENT_LOG_SIZE ? total : EVENT_LOG_SIZE; }
+  uint16_t getTotal() { return total; }
+  // 0 - самое старое
+  const Event &get(uint8_t i) {
+    return events[(head - size() + i) & (EVENT_LOG_SIZE - 1)];
+  }
+  void mirror() { pending = true; }
+  void run() {
+    if (!pending || !next_mirror.tick(EVENT_MIRROR_TIME)) {
+      return;
+    }
+    if (mirrored == total) {
+      pending = false;
+      return;
+    }
+    // вытесненные из кольца до записи пропускаются, их слоты уже заняты
+    if (static_cast<uint16_t>(total - mirrored) > EVENT_LOG_SIZE) {
+      mirrored = total - EVENT_LOG_SIZE;
+      stored = 0;
+    }
+    uint8_t slot = mirrored & (EVENT_LOG_SIZE - 1);
+    EEPROM.put(slotAddress(slot), events[slot]);
+    mirrored++;
+    if (stored < EVENT_LOG_SIZE) {
+      stored++;
+    }
+    EEPROM.update(EVENT_LOG_ADDRESS, EVENT_LOG_MARK | stored);
+    EEPROM.update(EVENT_LOG_ADDRESS + 1, mirrored & (EVENT_LOG_SIZE - 1));
+  }
+  // [время сейчас][события от старых к новым]; saved - копия из EEPROM
+  uint8_t copy(uint8_t *out, bool saved) {
+    putEventTime(out, uptimeTicks());
+    uint8_t n = size();
+    uint8_t end = head;
+    if (saved) {
+      n = EEPROM.read(EVENT_LOG_ADDRESS);
+      end = EEPROM.read(EVENT_LOG_ADDRESS + 1);
+      // копия прежнего формата или пустая EEPROM
+      n = (n & EVENT_LOG_MARK) ? n & ~EVENT_LOG_MARK : 0;
+      if (n > EVENT_LOG_SIZE || end >= EVENT_LOG_SIZE) {
+        n = 0;
+      }
+    }
+    for (uint8_t i = 0; i < n; i++) {
+      Event e = get(i);
+      if (saved) {
+        EEPROM.get(slotAddress((end - n + i) & (EVENT_LOG_SIZE - 1)), e);
+      }
+      memcpy(out + EVENT_TIME_SIZE + i * sizeof(Event), &e, sizeof(Event));
+    }
+    return EVENT_TIME_SIZE + n * sizeof(Event);
+  }
+};
+EventLog eventLog;
 class EEPROMHandler {
 private:
-  unsigned long next_save = 0;
+  Deadline next_save;
   void save() {
     EEPROM.put(0, data);
+    eventLog.add(EVENT_SAVE);
   };
   void initData() {
+    data = {};
     data.version = dataVersion;
-    data.pump_speed = 15.5;
-    data.pump_coeff = 1.95;
-    data.tsa = 42;
-    data.nbk_bard = 98.7;
-    data.nbk_output = 90.2;
-    data.nbk_delta = 0.3;
-    data.nbk_watt = 3000;
-    data.nbk_to_myself = 5;
+    for (uint8_t i = 0; i < REGISTER_COUNT; i++) {
+      setRegister(data, PACKET_REGISTER + i,
+                  pgm_read_word(&REGISTERS[i].def));
+    }
     copy(tsa, data.tsa_addr);
     copy(nbk_bard, data.bard_addr);
     copy(nbk_output, data.output_addr);
-
-    data.rect_cube_tail = 91;
-    data.rect_cube_end = 96;
-    data.rect_output = 45;
-    data.rect_delta = 0.3;
-    data.rect_delta_tail = 0.5;
-    data.rect_watt = 2800;
-    data.rect_speed_head = 150;
-    data.rect_speed_body = 2100;
-    data.rect_speed_reduction = 10;
-    data.rect_to_myself = 60;
+  }
+  // Перенос настроек из раскладки прошлой версии поверх значений по
+  // умолчанию, false - раскладка неизвестна
+  bool migrate(uint8_t version) {
+    Legacy l;
+    uint8_t n = 0;
+    for (; n < sizeof(LEGACIES) / sizeof(Legacy); n++) {
+      memcpy_P(&l, &LEGACIES[n], sizeof(Legacy));
+      if (l.version == version) {
+        break;
+      }
+    }
+    if (n == sizeof(LEGACIES) / sizeof(Legacy)) {
+      return false;
+    }
+    for (uint8_t i = 0; i < l.count; i++) {
+      LegacyField f;
+      memcpy_P(&f, &l.fields[i], sizeof(LegacyField));
+      float v;
+      uint16_t w;
+      uint8_t b;
+      switch (f.type) {
+      case LEGACY_FLOAT10:
+      case LEGACY_FLOAT100:
+        EEPROM.get(f.offset, v);
+        v *= f.type == LEGACY_FLOAT10 ? 10 : 100;
+        w = v < 0 ? 0 : v > 0xFFFF ? 0xFFFF : static_cast<uint16_t>(v + 0.5F);
+        break;
+      case LEGACY_UINT16:
+        EEPROM.get(f.offset, w);
+        break;
+      default:
+        EEPROM.get(f.offset, b);
+        w = b;
+      }
+      setRegister(data, f.reg, w);
+    }
+    EEPROM.get(l.addresses, data.tsa_addr);
+    EEPROM.get(l.addresses + sizeof(DeviceAddress), data.bard_addr);
+    EEPROM.get(l.addresses + 2 * sizeof(DeviceAddress), data.output_addr);
+    return true;
   }
 public:
   void load() {
     EEPROM.get(0, data);
     if (data.version != dataVersion) {
+      uint8_t version = data.version;
       initData();
+      if (migrate(version)) {
+        eventLog.add(EVENT_MIGRATE, version);
+      }
       saveTask();
     }
   }
-  void saveTask() { next_save = millis() + 10000; }
+  void saveTask() { next_save.start(10000); }
+  void commit() {
+    save();
+    next_save.stop();
+  }
   bool check() {
-    if (next_save < millis() && next_save > 0) {
+    if (next_save.isArmed() && next_save.expired()) {
       save();
-      next_save = 0;
+      next_save.stop();
       return true;
     }
     return false;
@@ -183,14 +616,31 @@ EEPROMHandler eepromHandler;
 
 class Pump {
 private:
-  float all_pulses = 0;
-  float pulses = 0;
-  unsigned long nextWriteTime = 0;
-  unsigned long nextCalculateTime = 0;
+  // меняются в прерывании датчика потока, читаются через takePulses и
+  // allPulses
+  volatile uint32_t all_pulses = 0;
+  volatile uint16_t pulses = 0;
+  Deadline nextWriteTime;
+  Deadline nextCalculateTime;
   bool enabled;
   bool sleep = true;
   bool full = false;
-  float accuracy = 0.35F;
+  const Q8 accuracy = Q8::ratio(35, 100);
+  Q8 target;
+
+  uint16_t takePulses() {
+    uint16_t n;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      n = pulses;
+      pulses = 0;
+    }
+    return n;
+  }
+  uint32_t allPulses() {
+    uint32_t n;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { n = all_pulses; }
+    return n;
+  }
 
 public:
   uint16_t p = 512;
@@ -206,6 +656,8 @@ public:
     }
   }
   bool isSleep() { return sleep; }
+  void setTarget(float t) { target = Q8::fromFloat(t); }
+  float getTarget() { return target.toFloat(); }
   void pwm(uint16_t l = 9999) {
     if (sleep && !calibration) {
       l = 0;
@@ -218,30 +670,31 @@ public:
       a = 256;
     }
     enabled = p > 0 ? true : false;
-    if (a >= PWM_MAX) {
-      digitalWrite(MOSFET_PIN, HIGH);
-      return;
-    }
-    if (a <= 0) {
-      digitalWrite(MOSFET_PIN, LOW);
+    // таймер 1 в 10-битном fast PWM, крайние значения - без ШИМ
+    if (a >= PWM_MAX || a == 0) {
+      TCCR1A &= ~_BV(COM1A1);
+      MosfetPin::write(a != 0);
       return;
     }
-    analogWrite(MOSFET_PIN, a);
+    OCR1A = a;
+    TCCR1A |= _BV(COM1A1);
   }
 
   void calibrate() {
     if (!calibration) {
       calibration = true;
       pwm(450);
-      pulses = 0;
+      takePulses();
     } else {
       pwm(0);
-      if (pulses == 0) {
-        pulses = 200;
+      uint16_t n = takePulses();
+      if (n == 0) {
+        n = 200;
       }
-      data.pump_coeff = pulses / 200;
+      //x100 от импульсов на 200 оборотов
+      n /= 2;
+      data.pump_coeff = n < 10 ? 10 : n > 1000 ? 1000 : n;
       calibration = false;
-      pulses = 0;
     }
   }
   void pulse() {
@@ -249,46 +702,45 @@ public:
     pulses++;
   }
 
-  float getSpeed() {
-    float s = 0;
+  // импульсов в секунду / pump_coeff * 3.6 одним делением, чтобы не терять
+  // точность на малом pump_coeff
+  Q8 speed() {
+    uint32_t s = 0;
     for (uint8_t i = 0; i < PUMP_CONTROL_SECOND; i++) {
       s = s + tick[i];
     }
-    s = s / PUMP_CONTROL_SECOND;
     if (s == 0) {
-      return 0;
+      return Q8();
     }
-    float lh = s / data.pump_coeff * 3.6F;
-    return lh;
+    return Q8::ratio(s * 360, PUMP_CONTROL_SECOND * data.pump_coeff);
   }
+  float getSpeed() { return speed().toFloat(); }
 
   void writePulses() {
-    if (nextWriteTime > millis()) {
+    if (!nextWriteTime.tick(1000)) {
       return;
     }
-    nextWriteTime = millis() + 1000;
     if (calibration) {
       return;
     }
     for (uint8_t i = PUMP_CONTROL_SECOND - 1; i > 0; i--) {
       tick[i] = tick[i - 1];
     }
-    tick[0] = pulses;
-    pulses = 0;
+    tick[0] = takePulses();
   }
 
   void calculate() {
     if (sleep) {
       return;
     }
-    if (nextCalculateTime > millis()) {
+    if (!nextCalculateTime.tick(CALCULATE_TIME)) {
       return;
     }
-    nextCalculateTime = millis() + CALCULATE_TIME;
     if (manual || calibration) {
       return;
     }
-    if (getSpeed() < 0.5F) {
+    Q8 s = speed();
+    if (s < Q8::ratio(1, 2)) {
       p = PWM_MAX;
       pwm();
       full = true;
@@ -300,26 +752,25 @@ public:
       full = false;
       return;
     }
-    float c = getSpeed() - data.pump_speed;
-    if (c == 0) {
+    Q8 c = s - target;
+    Q8 a = c.abs();
+    bool over = c > Q8();
+    if (a < accuracy / 2) {
       return;
-    }
-    if (c < accuracy / 2 && c > -accuracy / 2) {
-      return;
-    } else if (c < accuracy && c > -accuracy) {
-      c > 0 ? p-- : p++;
-    } else if (c < accuracy * 3 && c > -accuracy * 3) {
-      c > 0 ? p -= 2 : p += 2;
-    } else if (c < accuracy * 7 && c > -accuracy * 7) {
-      c > 0 ? p -= 3 : p += 3;
+    } else if (a < accuracy) {
+      over ? p-- : p++;
+    } else if (a < accuracy * 3) {
+      over ? p -= 2 : p += 2;
+    } else if (a < accuracy * 7) {
+      over ? p -= 3 : p += 3;
     } else {
-      float c = getSpeed() / data.pump_speed;
-      if (c > 1.04F) {
-        c = 1.04F;
-      } else if (c < 0.96F) {
-        c = 0.96F;
+      Q8 k = s / target;
+      if (k > Q8::ratio(104, 100)) {
+        k = Q8::ratio(104, 100);
+      } else if (k < Q8::ratio(96, 100)) {
+        k = Q8::ratio(96, 100);
       }
-      p = p / c;
+      p = (Q8::fromInt(p) / k).toInt();
     }
     if (p > PWM_MAX) {
       p = PWM_MAX;
@@ -327,12 +778,9 @@ public:
     pwm();
   }
 
+  // с точностью 0.1 L
   float getLiters() {
-    float l = all_pulses / data.pump_coeff / 1000;
-    l *= 10;
-    l = floor(l + 0.5);
-    l /= 10;
-    return l;
+    return Q8::ratio(allPulses(), data.pump_coeff).round() / 10.0F;
   }
 };
 Pump pump;
@@ -341,7 +789,8 @@ private:
   float temp[3];
   bool r = true;
   bool error_braga[3];
-  unsigned long next_update = 0;
+  Deadline next_update;
+  unsigned long request_time = 0;
   bool isSaved(DeviceAddress d) {
     bool t = true;
     bool o = true;
@@ -399,18 +848,22 @@ public:
     DEVICE_ADDRESS[1] = &nbk_bard;
     DEVICE_ADDRESS[2] = &nbk_output;
 
-    next_update = millis() + 1000;
+    next_update.start(1000);
   }
   float getTsaTemp() { return temp[0]; }
   float getBardTemp() { return temp[1]; }
   float getCubeTemp() { return getBardTemp(); }
   float getOutputTemp() { return temp[2]; }
+  unsigned long getRequestTime() { return request_time; }
   int i = 0;
-  void read() {
+  // true - готово новое измерение
+  bool read() {
     if (r) {
       sensors.requestTemperatures();
+      request_time = millis();
+      next_update.start(1000);
       r = !r;
-    } else if (next_update <= millis()) {
+    } else if (sensors.isConversionComplete() || next_update.expired()) {
       float t;
       for (int i = 0; i < 3; i++) {
         t = sensors.getTempC(*DEVICE_ADDRESS[i]);
@@ -421,6 +874,7 @@ public:
           } else {
             error_braga[i] = false;
             t = 999;
+            eventLog.add(EVENT_SENSOR, i);
           }
         } else {
           if (error_braga[i] != false) {
@@ -434,115 +888,890 @@ public:
           temp[i] = t;
         }
       }
-      next_update = millis() + 1000;
       r = !r;
       read();
+      return true;
     }
+    return false;
   }
 };
 Temperature temperature;
+// Равновесие жидкость-пар этанол-вода при 760 мм рт. ст. (Perry): точки
+// заданы мольными долями и переводятся в %об при компиляции, по таблице
+// линейно в целых находятся крепость жидкости и пара по температуре кипения
+#define VLE_ETHANOL_ML 58.37 //мл/моль при 20 C
+#define VLE_WATER_ML 18.05
+#define VLE_NORMAL 760 //мм рт. ст.
+#define ABV_UNKNOWN 999
+struct VlePoint {
+  uint16_t t;      //x100 C
+  uint16_t liquid; //x10 %об
+  uint16_t vapour; //x10 %об
+};
+constexpr uint16_t vleAbv(double x) {
+  return x * VLE_ETHANOL_ML /
+             (x * VLE_ETHANOL_ML + (1 - x) * VLE_WATER_ML) * 1000 +
+         0.5;
+}
+constexpr VlePoint vlePoint(double t, double x, double y) {
+  return {static_cast<uint16_t>(t * 100 + 0.5), vleAbv(x), vleAbv(y)};
+}
+constexpr VlePoint VLE[] PROGMEM = {
+    vlePoint(78.15, 0.8943, 0.8943), vlePoint(78.41, 0.7472, 0.7815),
+    vlePoint(78.74, 0.6763, 0.7385), vlePoint(79.3, 0.5732, 0.6841),
+    vlePoint(79.7, 0.5198, 0.6599),  vlePoint(79.8, 0.5079, 0.6564),
+    vlePoint(80.7, 0.3965, 0.6122),  vlePoint(81.5, 0.3273, 0.5826),
+    vlePoint(82.3, 0.2608, 0.5580),  vlePoint(82.7, 0.2337, 0.5445),
+    vlePoint(84.1, 0.1661, 0.5089),  vlePoint(85.3, 0.1238, 0.4704),
+    vlePoint(86.7, 0.0966, 0.4375),  vlePoint(89.0, 0.0721, 0.3891),
+    vlePoint(95.5, 0.0190, 0.1700),  vlePoint(100.0, 0, 0)};
+#define VLE_SIZE (sizeof(VLE) / sizeof(VlePoint))
+constexpr bool isVleTable(const VlePoint *p, uint8_t i) {
+  return i + 1 == VLE_SIZE ||
+         (p[i].t < p[i + 1].t && p[i].liquid >= p[i + 1].liquid &&
+          p[i].vapour >= p[i + 1].vapour && isVleTable(p, i + 1));
+}
+static_assert(isVleTable(VLE, 0), "VLE must rise in temperature");
+// Крепость по температуре кипения: бинарный поиск по 16 точкам (4 чтения
+// из flash) и интерполяция в целых
+class Strength {
+private:
+  // x10 %об; t - x100 C, приведённая к 760 мм рт. ст.
+  uint16_t lookup(int32_t t, bool vapour) {
+    if (t <= static_cast<int32_t>(pgm_read_word(&VLE[0].t))) {
+      t = pgm_read_word(&VLE[0].t);
+    }
+    uint8_t lo = 0;
+    uint8_t hi = VLE_SIZE - 1;
+    if (t >= static_cast<int32_t>(pgm_read_word(&VLE[hi].t))) {
+      return 0;
+    }
+    while (hi - lo > 1) {
+      uint8_t m = (lo + hi) / 2;
+      if (static_cast<int32_t>(pgm_read_word(&VLE[m].t)) <= t) {
+        lo = m;
+      } else {
+        hi = m;
+      }
+    }
+    VlePoint a, b;
+    memcpy_P(&a, &VLE[lo], sizeof(VlePoint));
+    memcpy_P(&b, &VLE[hi], sizeof(VlePoint));
+    int32_t va = vapour ? a.vapour : a.liquid;
+    int32_t vb = vapour ? b.vapour : b.liquid;
+    return va + (vb - va) * (t - a.t) / (b.t - a.t);
+  }
+  // у кипения смеси около 0.036 C на мм рт. ст.
+  int32_t normal(float t) {
+    int32_t c = static_cast<int32_t>(t * 100 + 0.5);
+    if (data.pressure != 0) {
+      c -= (static_cast<int32_t>(data.pressure) - VLE_NORMAL) * 18 / 5;
+    }
+    return c;
+  }
+  float abv(float t, bool vapour) {
+    if (t == 999) {
+      return ABV_UNKNOWN;
+    }
+    return lookup(normal(t), vapour) / 10.0;
+  }
+
+public:
+  // крепость жидкости в кубе
+  float getCubeAbv() { return abv(temperature.getCubeTemp(), false); }
+  // крепость пара на выходе, то есть отбора
+  float getOutputAbv() { return abv(temperature.getOutputTemp(), true); }
+};
+Strength strength;
+// Сглаженное значение и скорость его изменения, C/min.
+// add() вызывается раз в секунду
+class Trend {
+private:
+  float value = 0;
+  float slope = 0;
+  float k;
+  float ks;
+  bool empty = true;
+
+public:
+  Trend(float k = 0.3F, float ks = 0.05F) : k(k), ks(ks) {}
+  void add(float v) {
+    if (empty) {
+      value = v;
+      slope = 0;
+      empty = false;
+      return;
+    }
+    float prev = value;
+    value += k * (v - value);
+    slope += ks * ((value - prev) * 60 - slope);
+  }
+  void reset() { empty = true; }
+  float getValue() { return value; }
+  float getSlope() { return slope; }
+};
+// Реле тэнов включаются низким уровнем, клапан отбора и охлаждение - высоким
+template <uint8_t ONE, uint8_t TWO, uint8_t VALVE, uint8_t COOLER>
 class Relay {
 private:
   bool teng_one = false;
   bool teng_two = false;
   bool selection_valve = false;
   bool cooler = false;
-  unsigned long selection_valve_open_time = 0;
+  Elapsed valve_open;
 
 public:
   void enableOne() {
-    digitalWrite(TENG_ONE_PIN, LOW);
+    Pin<ONE>::low();
     teng_one = true;
   }
   void disableOne() {
-    digitalWrite(TENG_ONE_PIN, HIGH);
+    Pin<ONE>::high();
     teng_one = false;
   }
+  void setOne(bool on) { on ? enableOne() : disableOne(); }
   bool isEnabledOne() { return teng_one; }
   void enableTwo() {
-    digitalWrite(TENG_TWO_PIN, LOW);
+    Pin<TWO>::low();
     teng_two = true;
   }
   void disableTwo() {
-    digitalWrite(TENG_TWO_PIN, HIGH);
+    Pin<TWO>::high();
     teng_two = false;
   }
+  void setTwo(bool on) { on ? enableTwo() : disableTwo(); }
   bool isEnabledTwo() { return teng_two; }
 
   void openSelectionValve() {
-    digitalWrite(SELECTION_VALVE_PIN, HIGH);
+    Pin<VALVE>::high();
     selection_valve = true;
-    selection_valve_open_time = millis();
+    valve_open.start();
   }
   void closeSelectionValve() {
-    digitalWrite(SELECTION_VALVE_PIN, LOW);
+    Pin<VALVE>::low();
     selection_valve = false;
   }
   bool isOpenSelectionValve() { return selection_valve; }
-  unsigned long getSelectionValveOpenTime() {
-    return selection_valve_open_time;
-  }
+  // мс с последнего открытия клапана отбора
+  uint32_t getValveElapsed() { return valve_open.get(); }
   void enableCooler() {
-    digitalWrite(COOLER_PIN, HIGH);
+    Pin<COOLER>::high();
     cooler = true;
   }
   void disableCooler() {
-    digitalWrite(COOLER_PIN, LOW);
+    Pin<COOLER>::low();
     cooler = false;
   }
   bool isEnabledCooler() { return cooler; }
   void setup() {
+    Pin<ONE>::output();
+    Pin<TWO>::output();
+    Pin<VALVE>::output();
+    Pin<COOLER>::output();
     disableOne();
     disableTwo();
     closeSelectionValve();
     disableCooler();
   }
 };
-Relay relay;
-enum Status {
-  OFF,
-  OVERCLOCK,
-  STABILIZATION,
-  HEAD,
-  BODY,
-  PROCESS,
-  TAIL,
-  END,
-  MANUAL,
-  ERROR_TSA,
-  ERROR_BARD
+Relay<TENG_ONE_PIN, TENG_TWO_PIN, SELECTION_VALVE_PIN, COOLER_PIN> relay;
+// Учёт энергии по времени включения каждого тэна и объёма отбора по времени
+// открытия клапана. Считается в целых: остатки в Вт*мс и (мл/ч)*мс
+// переносятся в Вт*ч и мл на каждом проходе
+class Meter {
+private:
+  unsigned long last = 0;
+  uint32_t heat_rest = 0;  //Вт*мс
+  uint32_t valve_rest = 0; //(мл/ч)*мс
+  uint16_t valve_dead = 0; //мс открытия клапана без отбора
+  bool valve_open = false;
+  uint32_t wh = 0;
+  uint16_t phase_wh[STATUS_COUNT] = {};
+  uint32_t on_time[2] = {}; //мс включения тэнов
+  uint32_t product = 0; //мл отбора
+  float liters_start = 0;
+  uint8_t phase = OFF;
+
+public:
+  void reset() {
+    heat_rest = 0;
+    valve_rest = 0;
+    wh = 0;
+    memset(phase_wh, 0, sizeof(phase_wh));
+    memset(on_time, 0, sizeof(on_time));
+    product = 0;
+    liters_start = pump.getLiters();
+  }
+  void setPhase(uint8_t s) { phase = s; }
+  void run() {
+    unsigned long t = millis() - last;
+    last = millis();
+    uint16_t dt = t > 1000 ? 1000 : t;
+    uint16_t w = 0;
+    if (relay.isEnabledOne()) {
+      on_time[0] += dt;
+      w += data.teng_one_watt;
+    }
+    if (relay.isEnabledTwo()) {
+      on_time[1] += dt;
+      w += data.teng_two_watt;
+    }
+    heat_rest += static_cast<uint32_t>(w) * dt;
+    while (heat_rest >= 3600000UL) {
+      heat_rest -= 3600000UL;
+      wh++;
+      phase_wh[phase]++;
+    }
+    bool open = relay.isOpenSelectionValve();
+    if (open && !valve_open) {
+      valve_dead = SELECTION_VALVE_OPEN_TIME;
+    }
+    valve_open = open;
+    if (!open) {
+      return;
+    }
+    if (valve_dead >= dt) {
+      valve_dead -= dt;
+      return;
+    }
+    dt -= valve_dead;
+    valve_dead = 0;
+    valve_rest += static_cast<uint32_t>(SELECTION_VALVE_COEFF) * dt;
+    while (valve_rest >= 3600000UL) {
+      valve_rest -= 3600000UL;
+      product++;
+    }
+  }
+  uint32_t getWh() { return wh; }
+  uint16_t getPhaseWh(uint8_t s) { return phase_wh[s]; }
+  uint32_t getOnTime(uint8_t teng) { return on_time[teng]; }
+  uint32_t getProduct() { return product; }
+  // мл: переработанной браги в НБК, отобранного продукта в ректификации
+  uint32_t getVolume(Mode m) {
+    if (m == RECT_MODE) {
+      return product;
+    }
+    float l = pump.getLiters() - liters_start;
+    return l > 0 ? static_cast<uint32_t>(l * 1000) : 0;
+  }
+  uint16_t getWhPerLiter(Mode m) {
+    uint32_t v = getVolume(m);
+    if (v == 0) {
+      return 0;
+    }
+    uint32_t r = wh * 1000 / v;
+    return r > 0xFFFF ? 0xFFFF : r;
+  }
+};
+Meter meter;
+// Мощность задаётся долей времени включения тэнов в окне heater_window:
+// сначала тэн один, остаток мощности - тэн два
+class Heater {
+private:
+  uint16_t power = 0;
+  uint16_t one_on = 0;
+  uint16_t two_on = 0;
+  unsigned long window_start = 0;
+  bool locked = false;
+
+  uint16_t onTime(uint16_t w, uint16_t rated) {
+    if (rated == 0 || w == 0) {
+      return 0;
+    }
+    if (w >= rated) {
+      return data.heater_window;
+    }
+    uint16_t t = static_cast<uint32_t>(data.heater_window) * w / rated;
+    if (t < HEATER_MIN_PULSE) {
+      return 0;
+    }
+    if (t + HEATER_MIN_PULSE > data.heater_window) {
+      return data.heater_window;
+    }
+    return t;
+  }
+
+  void calculate() {
+    uint16_t w = power;
+    one_on = onTime(w, data.teng_one_watt);
+    w = w > data.teng_one_watt ? w - data.teng_one_watt : 0;
+    two_on = onTime(w, data.teng_two_watt);
+  }
+
+public:
+  uint16_t getFullPower() { return data.teng_one_watt + data.teng_two_watt; }
+  void setPower(uint16_t w) {
+    if (locked) {
+      return;
+    }
+    if (w > getFullPower()) {
+      w = getFullPower();
+    }
+    if (w == power) {
+      return;
+    }
+    power = w;
+    calculate();
+  }
+  uint16_t getPower() { return power; }
+  void run() {
+    unsigned long t = millis() - window_start;
+    if (t >= data.heater_window) {
+      window_start = millis();
+      t = 0;
+      calculate();
+    }
+    relay.setOne(t < one_on);
+    relay.setTwo(t < two_on);
+  }
+  void stop() {
+    power = 0;
+    one_on = 0;
+    two_on = 0;
+    run();
+  }
+  void lock() {
+    locked = true;
+    stop();
+  }
+  void unlock() { locked = false; }
+};
+Heater heater;
+// Быстрая защита ТСА: проверяется на каждом готовом измерении прямо из loop
+// и выключает тэны в том же проходе, не дожидаясь NBK. Снимается выходом
+// из ERROR_TSA, но только когда ТСА уже ниже порога
+class Interlock {
+private:
+  uint8_t hold = 0;
+  bool tripped = false;
+  uint16_t reaction = 0; //мс от запроса измерения до отключения
+  uint16_t pass_max = 0; //мс, самый долгий проход loop
+
+public:
+  void check(float tsa, unsigned long requested) {
+    if (tsa <= data.tsa / 10.0F) {
+      hold = 0;
+      return;
+    }
+    if (tripped || ++hold < INTERLOCK_HOLD) {
+      return;
+    }
+    heater.lock();
+    tripped = true;
+    reaction = millis() - requested;
+    eventLog.add16(EVENT_INTERLOCK, reaction);
+  }
+  bool reset() {
+    if (!tripped) {
+      return true;
+    }
+    if (temperature.getTsaTemp() > data.tsa / 10.0F) {
+      return false;
+    }
+    tripped = false;
+    hold = 0;
+    heater.unlock();
+    return true;
+  }
+  bool isTripped() { return tripped; }
+  void pass(unsigned long t) {
+    if (t > pass_max) {
+      pass_max = t > 0xFFFF ? 0xFFFF : t;
+    }
+  }
+  uint16_t getReaction() { return reaction; }
+  uint16_t getPassMax() { return pass_max; }
+  void clearPassMax() { pass_max = 0; }
+};
+Interlock interlock;
+// ПИ-регулятор подачи браги по сглаженной температуре барды с упреждением
+// по мощности нагрева. Рабочая уставка живёт здесь, data.pump_speed -
+// только начальное значение.
+// С nbk_maximize подача сначала поднимается шагами, пока барда или выход не
+// начнут остывать, затем откатывается на nbk_backoff и дальше регулятор не
+// выходит за этот предел. Найденная подача запоминается для nbk_watt
+enum FeedProbe { PROBE_OFF, PROBE_UP, PROBE_HOLD };
+struct FeedRecord {
+  uint16_t watt;
+  float speed;
 };
-enum Mode { NBK_MODE, RECT_MODE };
+class Feed {
+private:
+  Q16 speed;
+  Q16 integral;
+  Q16 limit;
+  FeedProbe probe = PROBE_OFF;
+  uint8_t probe_time = 0;
+  uint8_t sag_time = 0;
+
+  Q16 lower() { return Q16::ratio(data.nbk_pump_min, 100); }
+  Q16 upper() {
+    return probe == PROBE_HOLD ? limit : Q16::ratio(data.nbk_pump_max, 100);
+  }
+  Q16 clamp(Q16 f) {
+    if (f < lower()) {
+      return lower();
+    }
+    if (f > upper()) {
+      return upper();
+    }
+    return f;
+  }
+  int logAddress(uint8_t i) { return FEED_LOG_ADDRESS + i * sizeof(FeedRecord); }
+  void hold() {
+    record(data.nbk_watt, speed.toFloat());
+    limit = clamp(speed * (100 - data.nbk_backoff) / 100);
+    probe = PROBE_HOLD;
+    eventLog.add16(EVENT_FEED_MAX, (speed * 100).toInt());
+    speed = limit;
+    integral = speed - feedForward();
+    buzzer.sing(BUZZER_INFO);
+  }
+  void probeUp(Trend &bard, Trend &output) {
+    float sag = -data.nbk_sag / 100.0F;
+    if (bard.getSlope() < sag || output.getSlope() < sag) {
+      probe_time = 0;
+      if (++sag_time >= FEED_SAG_TIME) {
+        hold();
+      }
+      return;
+    }
+    sag_time = 0;
+    if (++probe_time < FEED_PROBE_TIME) {
+      return;
+    }
+    probe_time = 0;
+    if (speed >= Q16::ratio(data.nbk_pump_max, 100)) {
+      hold();
+      return;
+    }
+    speed = clamp(speed + Q16::ratio(data.nbk_probe_step, 100));
+  }
+
+public:
+  Q16 feedForward() {
+    return Q16::ratio(static_cast<int32_t>(data.nbk_feed_ff) *
+                          heater.getPower(),
+                      100000);
+  }
+  // Подача ближайшей по мощности записи, пересчитанная на watt. 0 - нет записей
+  float learned(uint16_t watt) {
+    FeedRecord r;
+    float s = 0;
+    uint16_t near = 0xFFFF;
+    for (uint8_t i = 0; i < FEED_LOG_SIZE; i++) {
+      EEPROM.get(logAddress(i), r);
+      if (r.watt == 0 || r.watt == 0xFFFF || !(r.speed > 0)) {
+        continue;
+      }
+      uint16_t d = r.watt > watt ? r.watt - watt : watt - r.watt;
+      if (d < near) {
+        near = d;
+        s = r.speed * watt / r.watt;
+      }
+    }
+    return s;
+  }
+  void record(uint16_t watt, float s) {
+    FeedRecord r;
+    int8_t slot = -1;
+    for (uint8_t i = 0; i < FEED_LOG_SIZE; i++) {
+      EEPROM.get(logAddress(i), r);
+      if (r.watt == watt) {
+        slot = i;
+        break;
+      }
+    }
+    if (slot < 0) {
+      //новая мощность вытесняет самую старую запись
+      for (uint8_t i = 1; i < FEED_LOG_SIZE; i++) {
+        EEPROM.get(logAddress(i), r);
+        EEPROM.put(logAddress(i - 1), r);
+      }
+      slot = FEED_LOG_SIZE - 1;
+    }
+    r.watt = watt;
+    r.speed = s;
+    EEPROM.put(logAddress(slot), r);
+  }
+  void start(Q16 s) {
+    probe = dataFlag(DATA_NBK_MAXIMIZE) ? PROBE_UP : PROBE_OFF;
+    probe_time = 0;
+    sag_time = 0;
+    if (probe == PROBE_UP) {
+      float l = learned(data.nbk_watt);
+      if (l > 0) {
+        s = Q16::fromFloat(l) * (100 - data.nbk_backoff) / 100;
+      }
+    }
+    speed = clamp(s);
+    integral = speed - feedForward();
+  }
+  void adjust(Q16 f) {
+    speed = clamp(speed + f);
+    integral = integral + f;
+    eventLog.add16(EVENT_FEED, (speed * 100).toInt());
+  }
+  // Горячая барда - подачу увеличиваем. Перегрев выхода тоже означает
+  // нехватку подачи
+  void run(Trend &bard, Trend &output) {
+    if (probe == PROBE_UP) {
+      probeUp(bard, output);
+      return;
+    }
+    Q16 error = Q16::fromFloat(bard.getValue()) - Q16::ratio(data.nbk_bard, 10);
+    Q16 o = Q16::fromFloat(output.getValue()) - Q16::ratio(data.nbk_output, 10);
+    if (o > Q16() && o > error) {
+      error = o;
+    }
+    Q16 ff = feedForward();
+    Q16 p = error * data.nbk_kp / 100;
+    Q16 i = integral + error * data.nbk_ki / 1000;
+    // интеграл не накапливается за границами подачи
+    if (ff + p + i > upper()) {
+      i = upper() - ff - p;
+    } else if (ff + p + i < lower()) {
+      i = lower() - ff - p;
+    }
+    integral = i;
+    Q16 t = clamp(ff + p + i);
+    Q16 rate = Q16::ratio(data.nbk_feed_rate, 1000);
+    if (t > speed + rate) {
+      t = speed + rate;
+    } else if (t < speed - rate) {
+      t = speed - rate;
+    }
+    speed = t;
+  }
+  float getSpeed() { return speed.toFloat(); }
+  FeedProbe getProbe() { return probe; }
+};
+Feed feed;
+// Разгон с прогнозом: по наклону температуры выхода считается время до
+// рабочей температуры, и за lead секунд до неё мощность снижается до
+// рабочей. По забросу после разгона lead подстраивается, время разгона и
+// lead хранятся в EEPROM для каждого режима
+struct OverclockRecord {
+  uint16_t time; //с
+  uint16_t lead; //с
+};
+class Overclock {
+private:
+  OverclockRecord r;
+  Mode mode = NBK_MODE;
+  float target = 0;
+  float peak = 0;
+  Elapsed since_start;
+  Elapsed since_drop; //от снижения мощности до выхода на режим
+  uint16_t watch = 0;
+
+  int address(Mode m) {
+    return OVERCLOCK_LOG_ADDRESS + m * sizeof(OverclockRecord);
+  }
+
+public:
+  OverclockRecord read(Mode m) {
+    OverclockRecord o;
+    EEPROM.get(address(m), o);
+    if (o.lead == 0 || o.lead > OVERCLOCK_LEAD_MAX) {
+      o.lead = OVERCLOCK_LEAD;
+      o.time = 0;
+    }
+    return o;
+  }
+  void begin(Mode m, float t) {
+    mode = m;
+    r = read(m);
+    target = t;
+    since_start.start();
+    since_drop.reset();
+    watch = 0;
+  }
+  // true - пора переходить на рабочую мощность
+  bool run(Trend &output) {
+    if (!since_drop.isStarted() && output.getSlope() > 0 &&
+        (target - output.getValue()) * 60 < r.lead * output.getSlope()) {
+      since_drop.start();
+    }
+    return since_drop.isStarted();
+  }
+  bool isDropped() { return since_drop.isStarted(); }
+  void arrive(float output) {
+    since_start.stop();
+    since_drop.stop();
+    r.time = since_start.get() / 1000;
+    peak = output;
+    watch = OVERCLOCK_WATCH;
+    EEPROM.put(address(mode), r);
+  }
+  // Раз в секунду на стабилизации. Заброс - снижать раньше, долгий подход
+  // после снижения - позже
+  void track(float output) {
+    if (watch == 0) {
+      return;
+    }
+    if (output > peak) {
+      peak = output;
+    }
+    if (--watch > 0) {
+      return;
+    }
+    if (peak - target > OVERCLOCK_OVERSHOOT) {
+      if (r.lead + OVERCLOCK_LEAD_STEP <= OVERCLOCK_LEAD_MAX) {
+        r.lead += OVERCLOCK_LEAD_STEP;
+      }
+    } else if (since_drop.isStarted() &&
+               since_drop.get() / 1000 > 2UL * r.lead &&
+               r.lead > OVERCLOCK_LEAD_STEP) {
+      r.lead -= OVERCLOCK_LEAD_STEP;
+    }
+    EEPROM.put(address(mode), r);
+  }
+  void setLead(Mode m, uint16_t l) {
+    OverclockRecord o = read(m);
+    o.lead = l;
+    EEPROM.put(address(m), o);
+    if (m == mode) {
+      r.lead = l;
+    }
+  }
+};
+Overclock overclock;
+// Этапы процесса заданы таблицами: на каждый режим по строке на каждый
+// Status, достижимый в этом режиме, - переходы вперёд и назад, нагрев,
+// насос, обработчик, действия при входе, таймер и имя. NBK только исполняет
+// строку текущего этапа, новый режим добавляется таблицей
+enum PhaseHeat { HEAT_STOP, HEAT_OVERCLOCK, HEAT_WORK, HEAT_KEEP };
+enum PhasePump { PUMP_SLEEP, PUMP_RUN };
+enum PhaseRun {
+  RUN_NONE,
+  RUN_OVERCLOCK,
+  RUN_STABILIZATION,
+  RUN_HEAD,
+  RUN_TAKE_OFF,
+  RUN_PROCESS
+};
+#define ENTRY_STOP_TIME 0x01
+#define ENTRY_START_TIME 0x02
+#define ENTRY_OVERCLOCK 0x04
+#define ENTRY_TAKE_OFF 0x08 //отбор начинается заново
+#define ENTRY_BODY_RESET 0x10 //сброс скорости отбора тела
+#define ENTRY_FEED 0x20
+#define PHASE_NO_TIMER 0xFF
+struct Phase {
+  uint8_t status;
+  uint8_t next;
+  uint8_t back;
+  uint8_t heat;
+  uint8_t pump;
+  uint8_t run;
+  uint8_t entry;
+  uint8_t timer; //смещение в Data длительности этапа, мин
+  const char *name;
+};
+const char PHASE_OFF[] PROGMEM = "Off";
+const char PHASE_OVERCLOCK[] PROGMEM = "Overclock";
+const char PHASE_STABILIZATION[] PROGMEM = "Stabiliz";
+const char PHASE_HEAD[] PROGMEM = "Head";
+const char PHASE_BODY[] PROGMEM = "Body";
+const char PHASE_PROCESS[] PROGMEM = "Process";
+const char PHASE_TAIL[] PROGMEM = "Tail";
+const char PHASE_END[] PROGMEM = "END";
+const char PHASE_MANUAL[] PROGMEM = "Manual";
+const char PHASE_ERROR_TSA[] PROGMEM = "ERR_TSA";
+const char PHASE_ERROR_BARD[] PROGMEM = "ERR_BARD";
+constexpr Phase NBK_PHASES[] PROGMEM = {
+    {OFF, OVERCLOCK, MANUAL, HEAT_STOP, PUMP_SLEEP, RUN_NONE,
+     ENTRY_STOP_TIME, PHASE_NO_TIMER, PHASE_OFF},
+    {OVERCLOCK, STABILIZATION, OFF, HEAT_OVERCLOCK, PUMP_SLEEP, RUN_OVERCLOCK,
+     ENTRY_START_TIME | ENTRY_OVERCLOCK, PHASE_NO_TIMER, PHASE_OVERCLOCK},
+    {STABILIZATION, PROCESS, OVERCLOCK, HEAT_WORK, PUMP_SLEEP,
+     RUN_STABILIZATION, 0, offsetof(Data, nbk_to_myself),
+     PHASE_STABILIZATION},
+    {PROCESS, MANUAL, STABILIZATION, HEAT_WORK, PUMP_RUN, RUN_PROCESS,
+     ENTRY_FEED, PHASE_NO_TIMER, PHASE_PROCESS},
+    {END, OVERCLOCK, PROCESS, HEAT_STOP, PUMP_SLEEP, RUN_NONE,
+     ENTRY_STOP_TIME, PHASE_NO_TIMER, PHASE_END},
+    {MANUAL, OFF, PROCESS, HEAT_KEEP, PUMP_RUN, RUN_NONE, ENTRY_START_TIME,
+     PHASE_NO_TIMER, PHASE_MANUAL},
+    {ERROR_TSA, OFF, OFF, HEAT_STOP, PUMP_SLEEP, RUN_NONE, ENTRY_STOP_TIME,
+     PHASE_NO_TIMER, PHASE_ERROR_TSA},
+    {ERROR_BARD, OFF, OFF, HEAT_STOP, PUMP_SLEEP, RUN_NONE, ENTRY_STOP_TIME,
+     PHASE_NO_TIMER, PHASE_ERROR_BARD}};
+constexpr Phase RECT_PHASES[] PROGMEM = {
+    {OFF, OVERCLOCK, TAIL, HEAT_STOP, PUMP_SLEEP, RUN_NONE,
+     ENTRY_STOP_TIME | ENTRY_BODY_RESET, PHASE_NO_TIMER, PHASE_OFF},
+    {OVERCLOCK, STABILIZATION, OFF, HEAT_OVERCLOCK, PUMP_SLEEP, RUN_OVERCLOCK,
+     ENTRY_START_TIME | ENTRY_OVERCLOCK, PHASE_NO_TIMER, PHASE_OVERCLOCK},
+    {STABILIZATION, HEAD, OVERCLOCK, HEAT_WORK, PUMP_SLEEP, RUN_STABILIZATION,
+     0, offsetof(Data, rect_to_myself), PHASE_STABILIZATION},
+    {HEAD, BODY, STABILIZATION, HEAT_WORK, PUMP_SLEEP, RUN_HEAD,
+     ENTRY_START_TIME | ENTRY_BODY_RESET, PHASE_NO_TIMER, PHASE_HEAD},
+    {BODY, TAIL, HEAD, HEAT_WORK, PUMP_SLEEP, RUN_TAKE_OFF, ENTRY_TAKE_OFF,
+     PHASE_NO_TIMER, PHASE_BODY},
+    {PROCESS, MANUAL, STABILIZATION, HEAT_WORK, PUMP_RUN, RUN_NONE,
+     ENTRY_FEED, PHASE_NO_TIMER, PHASE_PROCESS},
+    {TAIL, OFF, BODY, HEAT_WORK, PUMP_SLEEP, RUN_TAKE_OFF, ENTRY_TAKE_OFF,
+     PHASE_NO_TIMER, PHASE_TAIL},
+    {END, OVERCLOCK, PROCESS, HEAT_STOP, PUMP_SLEEP, RUN_NONE, ENTRY_STOP_TIME,
+     PHASE_NO_TIMER, PHASE_END},
+    {MANUAL, OFF, PROCESS, HEAT_KEEP, PUMP_RUN, RUN_NONE, ENTRY_START_TIME,
+     PHASE_NO_TIMER, PHASE_MANUAL},
+    {ERROR_TSA, OFF, OFF, HEAT_STOP, PUMP_SLEEP, RUN_NONE, ENTRY_STOP_TIME,
+     PHASE_NO_TIMER, PHASE_ERROR_TSA},
+    {ERROR_BARD, OFF, OFF, HEAT_STOP, PUMP_SLEEP, RUN_NONE, ENTRY_STOP_TIME,
+     PHASE_NO_TIMER, PHASE_ERROR_BARD}};
+#define PHASE_COUNT(t) (sizeof(t) / sizeof(Phase))
+constexpr bool hasPhase(const Phase *p, uint8_t n, uint8_t s) {
+  return n > 0 && (p[n - 1].status == s || hasPhase(p, n - 1, s));
+}
+// строки по возрастанию Status, переходы только на этапы таблицы, OFF и
+// ERROR_* есть в каждом режиме
+constexpr bool isPhaseTable(const Phase *p, uint8_t n, uint8_t i) {
+  return i == n ||
+         ((i == 0 || p[i - 1].status < p[i].status) &&
+          hasPhase(p, n, p[i].next) && hasPhase(p, n, p[i].back) &&
+          isPhaseTable(p, n, i + 1));
+}
+constexpr bool isModeTable(const Phase *p, uint8_t n) {
+  return isPhaseTable(p, n, 0) && hasPhase(p, n, OFF) &&
+         hasPhase(p, n, ERROR_TSA) && hasPhase(p, n, ERROR_BARD) &&
+         hasPhase(p, n, END);
+}
+static_assert(isModeTable(NBK_PHASES, PHASE_COUNT(NBK_PHASES)),
+              "NBK_PHASES must be ordered and closed under transitions");
+static_assert(isModeTable(RECT_PHASES, PHASE_COUNT(RECT_PHASES)),
+              "RECT_PHASES must be ordered and closed under transitions");
+struct ModeInfo {
+  const Phase *phases;
+  uint8_t count;
+  const char *name;
+  uint8_t output; //смещение в Data рабочей температуры выхода, x10
+  uint8_t watt;   //смещение в Data рабочей мощности
+};
+const char MODE_NBK[] PROGMEM = "NBK";
+const char MODE_RECT[] PROGMEM = "RECT";
+constexpr ModeInfo MODES[] PROGMEM = {
+    {NBK_PHASES, PHASE_COUNT(NBK_PHASES), MODE_NBK,
+     offsetof(Data, nbk_output), offsetof(Data, nbk_watt)},
+    {RECT_PHASES, PHASE_COUNT(RECT_PHASES), MODE_RECT,
+     offsetof(Data, rect_output), offsetof(Data, rect_watt)}};
+static_assert(sizeof(MODES) / sizeof(ModeInfo) == MODE_COUNT,
+              "MODES must match Mode");
+// Защиты и переходы по порогам. Правило срабатывает, когда сигнал
+// hold+1 секунд подряд выше (ниже) порога: поле Data плюс offset
+enum RuleSignal {
+  SIGNAL_INTERLOCK,
+  SIGNAL_BARD,
+  SIGNAL_CUBE,
+  SIGNAL_OUTPUT,
+  SIGNAL_PUMP_SPEED,
+  SIGNAL_CUBE_ABV
+};
+enum RuleAction {
+  ACTION_NONE,
+  ACTION_STATUS,
+  ACTION_ARRIVE,    //разгон закончен, следующий этап
+  ACTION_PAUSE_TAIL //отбор стоит до перехода на хвосты
+};
+#define RULE_BELOW 0
+#define RULE_ABOVE 1
+#define RULE_NO_FIELD 0xFF
+#define RULE_ALARM 0x01    //непрерывный сигнал, иначе однократный
+#define RULE_HEAT_CUT 0x02 //тэны выключаются сразу
+#define RULE_VALVE 0x04    //клапан отбора закрывается
+#define RULE_BYTE 0x08     //порог - поле uint8, 0 выключает правило
+#define PHASE_BIT(s) (1 << (s))
+#define PHASES_ALL ((1 << STATUS_COUNT) - 1)
+#define MODE_BIT(m) (1 << (m))
+#define MODES_ALL ((1 << MODE_COUNT) - 1)
+struct Rule {
+  uint16_t phases; //маска Status
+  uint8_t modes;   //маска Mode
+  uint8_t signal;
+  uint8_t above;
+  uint8_t field; //смещение в Data порога (int16 x10, uint8 с RULE_BYTE)
+  int8_t offset;
+  uint8_t hold; //с
+  uint8_t action;
+  uint8_t status;
+  uint8_t buzzer;
+  uint8_t flags;
+};
+const Rule RULES[] PROGMEM = {
+    {PHASES_ALL & ~PHASE_BIT(ERROR_TSA), MODES_ALL, SIGNAL_INTERLOCK,
+     RULE_ABOVE, RULE_NO_FIELD, 0, 0, ACTION_STATUS, ERROR_TSA, BUZZER_ERROR,
+     RULE_ALARM | RULE_HEAT_CUT | RULE_VALVE},
+    {PHASE_BIT(OVERCLOCK), MODE_BIT(NBK_MODE), SIGNAL_OUTPUT, RULE_ABOVE,
+     offsetof(Data, nbk_output), 0, 5, ACTION_ARRIVE, OFF, BUZZER_INFO, 0},
+    {PHASE_BIT(OVERCLOCK), MODE_BIT(RECT_MODE), SIGNAL_OUTPUT, RULE_ABOVE,
+     offsetof(Data, rect_output), 0, 10, ACTION_ARRIVE, OFF, BUZZER_INFO, 0},
+    {PHASE_BIT(PROCESS), MODE_BIT(NBK_MODE), SIGNAL_PUMP_SPEED, RULE_BELOW,
+     RULE_NO_FIELD, 5, 30, ACTION_STATUS, END, BUZZER_END, RULE_ALARM},
+    {PHASE_BIT(PROCESS), MODE_BIT(NBK_MODE), SIGNAL_BARD, RULE_BELOW,
+     offsetof(Data, nbk_bard), -7, 30, ACTION_STATUS, ERROR_BARD,
+     BUZZER_ERROR, RULE_ALARM | RULE_HEAT_CUT},
+    {PHASE_BIT(PROCESS), MODE_BIT(NBK_MODE), SIGNAL_OUTPUT, RULE_ABOVE,
+     offsetof(Data, nbk_output), 7, 30, ACTION_STATUS, ERROR_BARD,
+     BUZZER_ERROR, RULE_ALARM | RULE_HEAT_CUT},
+    {PHASE_BIT(BODY), MODE_BIT(RECT_MODE), SIGNAL_CUBE, RULE_ABOVE,
+     offsetof(Data, rect_cube_tail), 0, 20, ACTION_PAUSE_TAIL, OFF,
+     BUZZER_END, RULE_ALARM | RULE_VALVE},
+    {PHASE_BIT(BODY) | PHASE_BIT(TAIL), MODE_BIT(RECT_MODE), SIGNAL_CUBE,
+     RULE_ABOVE, offsetof(Data, rect_cube_end), 0, 5, ACTION_STATUS, END,
+     BUZZER_END, RULE_ALARM | RULE_VALVE},
+    {PHASE_BIT(BODY), MODE_BIT(RECT_MODE), SIGNAL_CUBE_ABV, RULE_BELOW,
+     offsetof(Data, rect_abv_tail), 0, 20, ACTION_PAUSE_TAIL, OFF, BUZZER_END,
+     RULE_ALARM | RULE_VALVE | RULE_BYTE},
+    {PHASE_BIT(BODY) | PHASE_BIT(TAIL), MODE_BIT(RECT_MODE), SIGNAL_CUBE_ABV,
+     RULE_BELOW, offsetof(Data, rect_abv_end), 0, 5, ACTION_STATUS, END,
+     BUZZER_END, RULE_ALARM | RULE_VALVE | RULE_BYTE}};
+#define RULE_COUNT (sizeof(RULES) / sizeof(Rule))
 class NBK {
 private:
-  unsigned long next_run = 0;
-  uint8_t error_braga = 0;
-  uint8_t error_tsa = 0;
-  uint8_t error_bard = 0;
-  uint8_t error_output = 0;
-  uint8_t overclock_delay = 0;
+  Deadline next_run;
+  uint8_t rule_hold[RULE_COUNT] = {};
   uint8_t rect_pause_delay = 0;
   uint8_t rect_cancel_pause_delay = 0;
-  uint8_t tail_delay = 0;
-  uint8_t end_delay = 0;
   Status status = OFF;
-  unsigned long stab_end = 0;
-  Mode mode = NBK_MODE;
-  unsigned long start_time = 0;
-  unsigned long stop_time = 0;
+  Deadline stab_end;
+  Elapsed stab_time;
+  Elapsed steady;
+  float steady_output = 0;
+  float steady_cube = 0;
+  Mode mode = WITH_NBK ? NBK_MODE : RECT_MODE;
+  Elapsed run_time;
   uint16_t real_speed_body = 0;
+  uint8_t body_trim = 0;
   float start_body_temp = 0;
   uint16_t selection_valve_open_time = 0;
   bool pause_body = false;
   bool pause_tail = false;
-  unsigned long pause_start_time = 0;
-  void stop() {
-    if (relay.isEnabledOne()) {
-      relay.disableOne();
-    }
-    if (relay.isEnabledTwo()) {
-      relay.disableTwo();
+  Elapsed pause;
+  Trend bard;
+  Trend output;
+  Phase phase;
+  ModeInfo info;
+  // false - этапа s нет в таблице режима m
+  static bool findPhase(Mode m, uint8_t s, Phase *p = nullptr) {
+    ModeInfo i;
+    memcpy_P(&i, &MODES[m], sizeof(ModeInfo));
+    for (uint8_t n = 0; n < i.count; n++) {
+      if (pgm_read_byte(&i.phases[n].status) == s) {
+        if (p != nullptr) {
+          memcpy_P(p, &i.phases[n], sizeof(Phase));
+        }
+        return true;
+      }
     }
+    return false;
+  }
+  void load() {
+    memcpy_P(&info, &MODES[mode], sizeof(ModeInfo));
+    findPhase(mode, status, &phase);
+  }
+  void stop() {
+    heater.stop();
     if (!pump.isSleep()) {
       pump.setSleep(true);
     }
@@ -551,82 +1780,24 @@ private:
     }
   }
   void relayCheck() {
-    switch (status) {
-    case OFF:
-      stop();
-      break;
-    case ERROR_TSA:
+    switch (phase.heat) {
+    case HEAT_STOP:
       stop();
       break;
-    case ERROR_BARD:
-      stop();
-      break;
-    case END:
-      stop();
-      break;
-    case OVERCLOCK:
-      if (!relay.isEnabledOne()) {
-        relay.enableOne();
-      }
-      if (!relay.isEnabledTwo()) {
-        relay.enableTwo();
-      }
-      if (!pump.isSleep()) {
-        pump.setSleep(true);
-      }
-      break;
-    case STABILIZATION:
-      if (!relay.isEnabledOne()) {
-        relay.enableOne();
-      }
-      if (relay.isEnabledTwo()) {
-        relay.disableTwo();
-      }
-      if (!pump.isSleep()) {
-        pump.setSleep(true);
-      }
-      break;
-    case HEAD:
-      if (!relay.isEnabledOne()) {
-        relay.enableOne();
-      }
-      if (relay.isEnabledTwo()) {
-        relay.disableTwo();
-      }
-      if (!pump.isSleep()) {
-        pump.setSleep(true);
-      }
-      break;
-    case BODY:
-      if (!relay.isEnabledOne()) {
-        relay.enableOne();
-      }
-      if (relay.isEnabledTwo()) {
-        relay.disableTwo();
-      }
-      if (!pump.isSleep()) {
-        pump.setSleep(true);
-      }
-      break;
-    case PROCESS:
-      if (!relay.isEnabledOne()) {
-        relay.enableOne();
-      }
-      if (relay.isEnabledTwo()) {
-        relay.disableTwo();
-      }
-      if (pump.isSleep()) {
-        pump.setSleep(false);
-      }
+    case HEAT_OVERCLOCK:
+      heater.setPower(overclock.isDropped() ? getWatt()
+                                            : heater.getFullPower());
       break;
-    case MANUAL:
-      if (pump.isSleep()) {
-        pump.setSleep(false);
-      }
+    case HEAT_WORK:
+      heater.setPower(getWatt());
       break;
     default:
       break;
     }
+    if (phase.heat != HEAT_STOP &&
+        pump.isSleep() != (phase.pump == PUMP_SLEEP)) {
+      pump.setSleep(phase.pump == PUMP_SLEEP);
+    }
     uint8_t i = 70;
     if (!relay.isEnabledCooler()) {
       if (temperature.getOutputTemp() > i || temperature.getCubeTemp() > i) {
@@ -638,212 +1809,88 @@ private:
       }
     }
   }
-  void time(Status s) {
-    unsigned long l = 0;
-    switch (s) {
-    case OFF:
-      stop_time = millis();
-      break;
-    case END:
-      stop_time = millis();
-      break;
-    case OVERCLOCK:
-      start_time = millis();
-      stab_end = 0;
-      break;
-    case STABILIZATION:
-      if (mode == NBK_MODE) {
-        l = data.nbk_to_myself;
-      } else if (mode == RECT_MODE) {
-        l = data.rect_to_myself;
-      }
-      l = l * 60000;
-      stab_end = l + millis();
-      break;
-    case HEAD:
-      start_time = millis();
-      stab_end = 0;
-      break;
-    case BODY:
-      selection_valve_open_time = 0;
-      break;
-    case PROCESS:
-      stab_end = 0;
-      break;
-    case TAIL:
+  uint16_t getWatt() { return dataField<uint16_t>(info.watt); }
+  float getOutputTarget() { return dataField<int16_t>(info.output) / 10.0F; }
+  void enter() {
+    uint8_t e = phase.entry;
+    stab_end.stop();
+    if (e & ENTRY_STOP_TIME) {
+      run_time.stop();
+    }
+    if (e & ENTRY_START_TIME) {
+      run_time.start();
+    }
+    if (e & ENTRY_OVERCLOCK) {
+      overclock.begin(mode, getOutputTarget());
+    }
+    if (phase.timer != PHASE_NO_TIMER) {
+      stab_end.start(dataField<uint8_t>(phase.timer) * 60000UL);
+      stab_time.start();
+      steady.reset();
+    }
+    if (e & ENTRY_TAKE_OFF) {
       pause_tail = false;
       selection_valve_open_time = 0;
-      break;
-    case MANUAL:
-      start_time = millis();
-      break;
-    case ERROR_TSA:
-      stop_time = millis();
-      break;
-    case ERROR_BARD:
-      stop_time = millis();
-      break;
-    default:
-      break;
+      body_trim = 0;
+    }
+    if (e & ENTRY_BODY_RESET) {
+      real_speed_body = 0;
+      selection_valve_open_time = 0;
+    }
+    if (WITH_NBK && (e & ENTRY_FEED)) {
+      feed.start(Q16::ratio(data.pump_speed, 100));
     }
   }
 
 public:
-  unsigned long getStartTime() { return start_time; }
-  unsigned long getStopTime() { return stop_time; }
-  void setStatus(Status s) {
+  // мс от начала запуска, после остановки - длительность запуска
+  uint32_t getRunTime() { return run_time.get(); }
+  NBK() { load(); }
+  bool setStatus(Status s) {
+    if (!findPhase(mode, s) || (s != ERROR_TSA && !interlock.reset())) {
+      return false;
+    }
+    eventLog.add(EVENT_STATUS, status, s);
+    if (status == OFF && s != OFF) {
+      meter.reset();
+    }
+    meter.setPhase(s);
     status = s;
-    time(s);
+    load();
+    enter();
+    return true;
   }
   String getStringStatus() {
-    switch (status) {
-    case OFF:
-      return "Off";
-    case END:
-      return "END";
-    case OVERCLOCK:
-      return "Overclock";
-    case STABILIZATION:
-      return "Stabiliz";
-    case HEAD:
-      return "Head";
-    case BODY:
-      return "Body";
-    case TAIL:
-      return "Tail";
-    case PROCESS:
-      return "Process";
-    case MANUAL:
-      return "Manual";
-    case ERROR_TSA:
-      return "ERR_TSA";
-    case ERROR_BARD:
-      return "ERR_BARD";
-    default:
-      break;
+    if (WITH_NBK && status == PROCESS && feed.getProbe() == PROBE_UP) {
+      return "Probe";
     }
-    return ERR;
+    return String(reinterpret_cast<const __FlashStringHelper *>(phase.name));
   }
 
   Status getStatus() { return status; }
 
-  void nextStatus() {
-    switch (status) {
-    case OFF:
-      setStatus(OVERCLOCK);
-      break;
-    case END:
-      setStatus(OVERCLOCK);
-      break;
-    case OVERCLOCK:
-      setStatus(STABILIZATION);
-      break;
-    case STABILIZATION:
-      if (mode == NBK_MODE) {
-        setStatus(PROCESS);
-      } else if (mode == RECT_MODE) {
-        setStatus(HEAD);
-      }
-      break;
-    case HEAD:
-      setStatus(BODY);
-      break;
-    case BODY:
-      setStatus(TAIL);
-      break;
-    case TAIL:
-      setStatus(OFF);
-      real_speed_body = 0;
-      selection_valve_open_time = 0;
-      break;
-    case PROCESS:
-      setStatus(MANUAL);
-      break;
-    case MANUAL:
-      setStatus(OFF);
-      break;
-    default:
-      setStatus(OFF);
-      break;
-    }
+  void nextStatus() { setStatus(static_cast<Status>(phase.next)); }
+  void backStatus() { setStatus(static_cast<Status>(phase.back)); }
+  static bool isBuilt(Mode m) { return m == NBK_MODE ? WITH_NBK : WITH_RECT; }
+  // режим меняется только на этапе, который есть и в новом режиме
+  bool setMode(Mode mode) {
+    if (!isBuilt(mode) || !findPhase(mode, status)) {
+      return false;
+    }
+    eventLog.add(EVENT_MODE, mode);
+    this->mode = mode;
+    load();
+    return true;
   }
-  void backStatus() {
-    switch (status) {
-    case OFF:
-      if (getMode() == NBK_MODE) {
-        setStatus(MANUAL);
-      } else if (getMode() == RECT_MODE) {
-        setStatus(TAIL);
-      }
-      break;
-    case END:
-      setStatus(PROCESS);
-      break;
-    case OVERCLOCK:
-      setStatus(OFF);
-      break;
-    case STABILIZATION:
-      setStatus(OVERCLOCK);
-      break;
-    case HEAD:
-      setStatus(STABILIZATION);
-      break;
-    case BODY:
-      setStatus(HEAD);
-      real_speed_body = 0;
-      selection_valve_open_time = 0;
-      break;
-    case TAIL:
-      setStatus(BODY);
-      break;
-    case PROCESS:
-      setStatus(STABILIZATION);
-      break;
-    case MANUAL:
-      setStatus(PROCESS);
-      break;
-    default:
-      setStatus(OFF);
-      break;
-    }
-  }
-  void setMode(Mode mode) { this->mode = mode; }
 
   Mode getMode() { return mode; }
 
   String getStringMode() {
-    switch (mode) {
-    case NBK_MODE:
-      return "NBK";
-    case RECT_MODE:
-      return "RECT";
-    default:
-      return ERR;
-    }
-  }
-  void nextMode() {
-    switch (mode) {
-    case NBK_MODE:
-      setMode(RECT_MODE);
-      break;
-    case RECT_MODE:
-      setMode(NBK_MODE);
-      break;
-    default:
-      break;
-    }
+    return String(reinterpret_cast<const __FlashStringHelper *>(info.name));
   }
+  void nextMode() { setMode(static_cast<Mode>((mode + 1) % MODE_COUNT)); }
   void backMode() {
-    switch (mode) {
-    case NBK_MODE:
-      setMode(RECT_MODE);
-      break;
-    case RECT_MODE:
-      setMode(NBK_MODE);
-      break;
-    default:
-      break;
-    }
+    setMode(static_cast<Mode>((mode + MODE_COUNT - 1) % MODE_COUNT));
   }
   bool modeDelay(uint8_t &i, bool error, uint8_t time = 5) {
     if (error) {
@@ -858,184 +1905,243 @@ public:
     }
     return false;
   }
-  void runNBK() {
-    if (status == OVERCLOCK) {
-      if (temperature.getOutputTemp() > data.nbk_output) {
-        if (modeDelay(overclock_delay, true)) {
-          setStatus(STABILIZATION);
-          buzzer.sing(BUZZER_INFO);
-        }
-
-      } else {
-        modeDelay(overclock_delay, false);
-      }
+  // Отсчёт окна устойчивости начинается заново, как только выход или куб
+  // уходят из полосы stab_band или меняются быстрее stab_slope
+  void checkSteady() {
+    float band = data.stab_band / 100.0F;
+    float slope = data.stab_slope / 100.0F;
+    if (!steady.isStarted() ||
+        fabs(output.getValue() - steady_output) > band ||
+        fabs(bard.getValue() - steady_cube) > band ||
+        fabs(output.getSlope()) > slope || fabs(bard.getSlope()) > slope) {
+      steady.start();
+      steady_output = output.getValue();
+      steady_cube = bard.getValue();
+    }
+  }
+  // Остаток стабилизации, мс: по устойчивости, но не раньше stab_min и не
+  // позже nbk_to_myself/rect_to_myself
+  uint32_t getStabilizationLeft() {
+    uint32_t left = stab_end.left();
+    if (data.stab_window == 0 || !stab_end.isArmed() || !steady.isStarted()) {
+      return left;
+    }
+    uint32_t w = data.stab_window * 60000UL;
+    uint32_t m = data.stab_min * 60000UL;
+    uint32_t e = steady.get() >= w ? 0 : w - steady.get();
+    if (stab_time.get() < m && e < m - stab_time.get()) {
+      e = m - stab_time.get();
+    }
+    return e < left ? e : left;
+  }
+  float getSignal(uint8_t signal) {
+    switch (signal) {
+    case SIGNAL_INTERLOCK:
+      return interlock.isTripped() ? 1 : 0;
+    case SIGNAL_BARD:
+      return temperature.getBardTemp();
+    case SIGNAL_CUBE:
+      return temperature.getCubeTemp();
+    case SIGNAL_OUTPUT:
+      return temperature.getOutputTemp();
+    case SIGNAL_PUMP_SPEED:
+      return pump.getSpeed();
+    case SIGNAL_CUBE_ABV:
+      return WITH_RECT ? strength.getCubeAbv() : ABV_UNKNOWN;
+    default:
+      return 0;
     }
-    if (status == STABILIZATION) {
-      if (stab_end <= millis()) {
-        setStatus(PROCESS);
-        data.pump_speed = 10;
-        buzzer.sing(BUZZER_INFO);
-      }
+  }
+  void fire(uint8_t i, const Rule &r) {
+    if (r.flags & RULE_VALVE) {
+      selection_valve_open_time = 0;
     }
-    if (status == PROCESS) {
-      if (pump.getSpeed() < 5) {
-        error_braga++;
-        if (error_braga > 30) {
-          setStatus(END);
-          buzzer.setBuzzerType(BUZZER_END);
-          buzzer.setEnabled(true);
-        }
-      } else {
-        if (error_braga != 0) {
-          error_braga = 0;
-        }
-      }
-      if (temperature.getBardTemp() < data.nbk_bard - 7) {
-        error_bard++;
-        if (error_bard > 30) {
-          setStatus(ERROR_BARD);
-          buzzer.setBuzzerType(BUZZER_ERROR);
-          buzzer.setEnabled(true);
-        }
-      } else {
-        if (error_bard != 0) {
-          error_bard = 0;
+    if (r.flags & RULE_HEAT_CUT) {
+      heater.stop();
+    }
+    switch (r.action) {
+    case ACTION_STATUS:
+      setStatus(static_cast<Status>(r.status));
+      break;
+    case ACTION_ARRIVE:
+      overclock.arrive(temperature.getOutputTemp());
+      nextStatus();
+      break;
+    case ACTION_PAUSE_TAIL:
+      pause_tail = true;
+      break;
+    default:
+      break;
+    }
+    eventLog.add(EVENT_RULE, i, status);
+    if (r.flags & RULE_ALARM) {
+      buzzer.setBuzzerType(static_cast<BuzzerType>(r.buzzer));
+      buzzer.setEnabled(true);
+      eventLog.mirror();
+    } else {
+      buzzer.sing(static_cast<BuzzerType>(r.buzzer));
+    }
+  }
+  // Раз в секунду. Правила чужих этапов и режимов не копят выдержку
+  void checkRules() {
+    Rule r;
+    for (uint8_t i = 0; i < RULE_COUNT; i++) {
+      memcpy_P(&r, &RULES[i], sizeof(Rule));
+      float t = r.offset;
+      if (r.flags & RULE_BYTE) {
+        uint8_t b = dataField<uint8_t>(r.field);
+        if (b == 0) {
+          rule_hold[i] = 0;
+          continue;
         }
+        t += b;
+      } else if (r.field != RULE_NO_FIELD) {
+        t += dataField<int16_t>(r.field) / 10.0F;
       }
-      if (temperature.getOutputTemp() > data.nbk_output + 7) {
-        error_output++;
-        if (error_output > 30) {
-          setStatus(ERROR_BARD);
-          buzzer.setBuzzerType(BUZZER_ERROR);
-          buzzer.setEnabled(true);
-        }
-      } else {
-        if (error_output != 0) {
-          error_output = 0;
-        }
+      float v = getSignal(r.signal);
+      if (!(r.phases & PHASE_BIT(status)) || !(r.modes & MODE_BIT(mode)) ||
+          (r.above ? v <= t : v >= t)) {
+        rule_hold[i] = 0;
+        continue;
       }
-      float f = 0.01;
-      if (temperature.getBardTemp() > data.nbk_bard + data.nbk_delta ||
-          temperature.getOutputTemp() > data.nbk_output) {
-        if (data.pump_speed < 30) {
-          data.pump_speed += f;
-        }
-      } else if (temperature.getBardTemp() < data.nbk_bard - data.nbk_delta) {
-        if (data.pump_speed > 10) {
-          data.pump_speed -= f;
-        }
+      if (++rule_hold[i] > r.hold) {
+        rule_hold[i] = 0;
+        fire(i, r);
       }
     }
   }
-  void runRECT() {
-    if (status == OVERCLOCK) {
-      if (temperature.getOutputTemp() > data.rect_output) {
-        if (modeDelay(overclock_delay, true, 10)) {
-          setStatus(STABILIZATION);
-          buzzer.sing(BUZZER_INFO);
-        }
-      } else {
-        modeDelay(overclock_delay, false);
-      }
+  void runOverclock() { overclock.run(output); }
+  void runStabilization() {
+    checkSteady();
+    if (temperature.getOutputTemp() != 999) {
+      overclock.track(temperature.getOutputTemp());
     }
-    if (status == STABILIZATION) {
-      if (stab_end <= millis()) {
-        setStatus(HEAD);
-        buzzer.sing(BUZZER_INFO);
-      }
+    if (getStabilizationLeft() == 0) {
+      nextStatus();
+      buzzer.sing(BUZZER_INFO);
+    }
+  }
+  void runProcess() { feed.run(bard, output); }
+  // Отбор снижается пропорционально подъёму температуры выхода и скорости
+  // подъёма, не дожидаясь паузы по rect_delta
+  void trimBody(float rise) {
+    float t = 0;
+    if (rise > 0) {
+      t += rise * 10 * data.rect_trim_kp;
+    }
+    if (output.getSlope() > 0) {
+      t += output.getSlope() * 10 * data.rect_trim_kd;
+    }
+    if (t > RECT_TRIM_MAX) {
+      t = RECT_TRIM_MAX;
+    }
+    uint8_t trim = static_cast<uint8_t>(t);
+    if (trim == body_trim) {
+      return;
     }
-    if (status == HEAD) {
+    if (trim / 5 != body_trim / 5) {
+      eventLog.add(EVENT_TRIM, trim);
+    }
+    body_trim = trim;
+    selection_valve_open_time = calculateSelectionValveOpenTime(
+        static_cast<uint32_t>(real_speed_body) * (100 - trim) / 100);
+  }
+  void runHead() {
+    selection_valve_open_time =
+        calculateSelectionValveOpenTime(data.rect_speed_head);
+    // if(digitalRead(HEAD_FULL_PIN) == LOW){
+    //   if (modeDelay(head_full_delay, true, 5)) {
+    //     setStatus(BODY);
+    //   }
+    // } else {
+    //   modeDelay(head_full_delay, false);
+    // }
+  }
+  void runTakeOff() {
+    if (pause_tail) {
+      return;
+    }
+    float delta =
+        (status == BODY ? data.rect_delta : data.rect_delta_tail) / 10.0F;
+    if (selection_valve_open_time == 0 && !pause_body) {
       selection_valve_open_time =
-          calculateSelectionValveOpenTime(data.rect_speed_head);
-      // if(digitalRead(HEAD_FULL_PIN) == LOW){
-      //   if (modeDelay(head_full_delay, true, 5)) {
-      //     setStatus(BODY);
-      //   }
-      // } else {
-      //   modeDelay(head_full_delay, false);
-      // }
-    }
-    if (status == BODY || status == TAIL) {
-      if (pause_tail) {
-        return;
+          calculateSelectionValveOpenTime(data.rect_speed_body);
+      real_speed_body = data.rect_speed_body;
+      start_body_temp = temperature.getOutputTemp();
+    }
+    float rise = temperature.getOutputTemp() - start_body_temp;
+    bool valid = temperature.getOutputTemp() != 999;
+    if (valid && rise > delta && !pause_body) {
+      if (modeDelay(rect_pause_delay, true, 5)) {
+        selection_valve_open_time = 0;
+        real_speed_body = static_cast<uint32_t>(real_speed_body) *
+                          (100 - data.rect_speed_reduction) / 100;
+        body_trim = 0;
+        pause_body = true;
+        buzzer.sing(BUZZER_INFO);
+        pause.start();
+        eventLog.add16(EVENT_PAUSE, real_speed_body);
       }
-      float delta = status == BODY ? data.rect_delta : data.rect_delta_tail;
-      if (selection_valve_open_time == 0 && !pause_body) {
+    } else {
+      modeDelay(rect_pause_delay, false);
+    }
+    if (valid && !pause_body && selection_valve_open_time != 0) {
+      trimBody(rise);
+    }
+    // пауза заканчивается, когда выход вернулся и перестал меняться
+    if (pause_body && pause.get() > RECT_PAUSE_MIN &&
+        valid && rise <= delta &&
+        fabs(output.getSlope()) * 100 < data.rect_settle) {
+      if (modeDelay(rect_cancel_pause_delay, true, 5)) {
+        pause_body = false;
         selection_valve_open_time =
-            calculateSelectionValveOpenTime(data.rect_speed_body);
-        real_speed_body = data.rect_speed_body;
-        start_body_temp = temperature.getOutputTemp();
-      }
-      if (temperature.getOutputTemp() != 999 &&
-          temperature.getOutputTemp() > start_body_temp + delta &&
-          !pause_body) {
-        if (modeDelay(rect_pause_delay, true, 5)) {
-          selection_valve_open_time = 0;
-          float f = 1 - (static_cast<float>(data.rect_speed_reduction) / 100);
-          real_speed_body = real_speed_body * f;
-          pause_body = true;
-          buzzer.sing(BUZZER_INFO);
-          pause_start_time = millis();
-        }
-      } else {
-        modeDelay(rect_pause_delay, false);
-      }
-      if (pause_body && pause_start_time + RECT_DELTA_PAUSE < millis() &&
-          temperature.getOutputTemp() <= start_body_temp + delta) {
-        if (modeDelay(rect_cancel_pause_delay, true, 5)) {
-          pause_body = false;
-          selection_valve_open_time =
-              calculateSelectionValveOpenTime(real_speed_body);
-          buzzer.sing(BUZZER_INFO);
-        }
-      } else {
-        modeDelay(rect_cancel_pause_delay, false);
-      }
-      if (temperature.getCubeTemp() > data.rect_cube_tail && status != TAIL) {
-        if (modeDelay(tail_delay, true, 20)) {
-          selection_valve_open_time = 0;
-          pause_tail = true;
-          buzzer.setBuzzerType(BUZZER_END);
-          buzzer.setEnabled(true);
-        }
-      } else {
-        modeDelay(tail_delay, false);
-      }
-      if (temperature.getCubeTemp() > data.rect_cube_end) {
-        if (modeDelay(end_delay, true, 5)) {
-          setStatus(END);
-          selection_valve_open_time = 0;
-          buzzer.setBuzzerType(BUZZER_END);
-          buzzer.setEnabled(true);
-        }
-      } else {
-        modeDelay(end_delay, false);
+            calculateSelectionValveOpenTime(real_speed_body);
+        buzzer.sing(BUZZER_INFO);
+        eventLog.add16(EVENT_RESUME, pause.get() / 1000);
       }
+    } else {
+      modeDelay(rect_cancel_pause_delay, false);
     }
   }
   void run() {
-    if (next_run > millis()) {
+    if (!next_run.tick(1000)) {
       return;
     }
-    next_run = millis() + 1000;
-    if (temperature.getTsaTemp() > data.tsa) {
-      if (modeDelay(error_tsa, true, 10)) {
-        setStatus(ERROR_TSA);
-        buzzer.setBuzzerType(BUZZER_ERROR);
-        buzzer.setEnabled(true);
+    bard.add(temperature.getBardTemp());
+    output.add(temperature.getOutputTemp());
+    checkRules();
+    switch (phase.run) {
+    case RUN_OVERCLOCK:
+      runOverclock();
+      break;
+    case RUN_STABILIZATION:
+      runStabilization();
+      break;
+    case RUN_HEAD:
+      runHead();
+      break;
+    case RUN_TAKE_OFF:
+      if (WITH_RECT) {
+        runTakeOff();
       }
-    } else {
-      modeDelay(error_tsa, false);
-    }
-    if (mode == NBK_MODE) {
-      runNBK();
-    } else if (mode == RECT_MODE) {
-      runRECT();
+      break;
+    case RUN_PROCESS:
+      if (WITH_NBK) {
+        runProcess();
+      }
+      break;
+    default:
+      break;
     }
+    pump.setTarget(WITH_NBK && status == PROCESS ? feed.getSpeed()
+                                                 : data.pump_speed / 100.0F);
     relayCheck();
   }
 
   void selectionValveCheck() {
+    if (!WITH_RECT) {
+      return;
+    }
     if (selection_valve_open_time >= SELECTION_VALVE_TIME) {
       if (!relay.isOpenSelectionValve()) {
         relay.openSelectionValve();
@@ -1048,48 +2154,35 @@ public:
       return;
     }
     if (relay.isOpenSelectionValve()) {
-      if (relay.getSelectionValveOpenTime() + selection_valve_open_time <
-          millis()) {
+      if (relay.getValveElapsed() > selection_valve_open_time) {
         relay.closeSelectionValve();
       }
     } else {
-      if (relay.getSelectionValveOpenTime() + SELECTION_VALVE_TIME < millis()) {
+      if (relay.getValveElapsed() > SELECTION_VALVE_TIME) {
         relay.openSelectionValve();
       }
     }
   }
 
   unsigned long getStabilizationRestTime() {
-    if (stab_end < millis() || stab_end == 0) {
-      lcd.setCursor(0, 2);
-      lcd.print(stab_end);
-      return 0;
-    }
-    unsigned long l = stab_end;
-    l = l - millis();
-    l = l / 60000;
-    return l;
+    return getStabilizationLeft() / 60000;
   }
   void setStabilizationRestTime(uint8_t i) {
-    stab_end = millis() + (i * 60000);
-    stab_end = stab_end + 2000;
+    stab_end.start(i * 60000UL + 2000);
   }
 
   uint16_t getRealSpeedBody() { return real_speed_body; }
+  uint8_t getBodyTrim() { return body_trim; }
   void setRealSpeedBody(uint16_t i) { real_speed_body = i; }
+  // доля цикла клапана по скорости отбора плюс время открытия, мс
   uint16_t calculateSelectionValveOpenTime(uint16_t speed) {
     if (speed == 0) {
       return 0;
     }
-    float t = SELECTION_VALVE_TIME;
-    float c = SELECTION_VALVE_COEFF;
-    float s = speed;
-    float o = SELECTION_VALVE_OPEN_TIME;
-    float te = (t / (c / s)) + o;
-    if (te > t) {
-      te = t;
-    }
-    return static_cast<uint16_t>(te);
+    uint32_t te = static_cast<uint32_t>(SELECTION_VALVE_TIME) * speed /
+                      SELECTION_VALVE_COEFF +
+                  SELECTION_VALVE_OPEN_TIME;
+    return te > SELECTION_VALVE_TIME ? SELECTION_VALVE_TIME : te;
   }
   uint16_t getSelectionValveOpenTime() { return selection_valve_open_time; }
   void updateSpeedBody() {
@@ -1100,43 +2193,149 @@ public:
   void setStartBodyTemp(float f) { start_body_temp = f; }
 };
 NBK nbk;
+// Длительность запуска ЧЧ:ММ для экрана, пересчитывается раз в 10 с
 class Time {
 private:
-  unsigned long lastUpdate = 0;
-  unsigned long next_update = 0;
-  String lastTimeString = "00:00";
+  Deadline next_update;
+  uint16_t minutes = 0;
+  char text[6] = "00:00";
 
 public:
-  String getTime() {
-    if (next_update > millis()) {
-      return lastTimeString;
-    }
-    next_update = millis() + 10000;
-    unsigned long time;
-    if (nbk.getStartTime() == 0) {
-      time = 0;
-    } else if (nbk.getStopTime() != 0 &&
-               nbk.getStopTime() > nbk.getStartTime()) {
-      time = nbk.getStopTime() - nbk.getStartTime();
-    } else {
-      time = millis() - nbk.getStartTime();
-    }
-    if (lastUpdate == 0 || lastUpdate + 10000 < millis()) {
-      time = time / 1000;
-      int h = time / 3600;
-      int m = time % 3600 / 60;
-      lastTimeString = String(h / 10) + String(h % 10) + ":" + String(m / 10) +
-                       String(m % 10);
-      lastUpdate = millis();
+  void run() {
+    uptime(); //продолжает время от включения через переполнение millis()
+    if (!next_update.tick(10000)) {
+      return;
     }
-    return lastTimeString;
+    uint32_t s = nbk.getRunTime() / 1000;
+    minutes = s / 60;
+    formatTime(text, sizeof(text), s);
   }
-
-  unsigned long getLastUpdate() { return lastUpdate; }
+  const char *getTime() { return text; }
+  uint16_t getMinutes() { return minutes; }
 };
 
 Time time;
-enum Screen { PUMP_SCREEN, TEMPERATURES_SCREEN, RECT_SCREEN, TIME_SCREEN };
+// Оценка времени до конца запуска, пересчитывается раз в секунду.
+// НБК: остаток браги nbk_mash на сглаженную подачу. Ректификация: подъём
+// куба на мл отбора до rect_cube_end и текущая скорость отбора; пока
+// отбора нет (пауза) - по скорости подъёма куба во времени
+class Eta {
+private:
+  Deadline next_update;
+  uint32_t seconds = ETA_UNKNOWN;
+  Trend feed_trend;
+  Trend cube;
+  Trend per_ml; //C на мл отбора
+  uint32_t ref_product = 0;
+  float ref_cube = 0;
+
+  void reset() {
+    seconds = ETA_UNKNOWN;
+    feed_trend.reset();
+    cube.reset();
+    per_ml.reset();
+    ref_product = meter.getProduct();
+    ref_cube = 0;
+  }
+  uint32_t feedLeft() {
+    if (data.nbk_mash == 0) {
+      return ETA_UNKNOWN;
+    }
+    float left = data.nbk_mash - meter.getVolume(NBK_MODE) / 1000.0;
+    if (left <= 0) {
+      return 0;
+    }
+    float rate = data.pump_speed / 100.0F;
+    if (nbk.getStatus() == PROCESS) {
+      feed_trend.add(pump.getSpeed());
+      rate = feed_trend.getValue();
+    }
+    if (rate <= 0) {
+      return ETA_UNKNOWN;
+    }
+    uint32_t s = left / rate * 3600;
+    if (nbk.getStatus() == STABILIZATION) {
+      s += nbk.getStabilizationLeft() / 1000;
+    }
+    return s;
+  }
+  uint32_t cubeLeft() {
+    Status s = nbk.getStatus();
+    if (s != BODY && s != TAIL) {
+      ref_product = meter.getProduct();
+      return ETA_UNKNOWN;
+    }
+    float t = temperature.getBardTemp();
+    if (t == 999) {
+      return seconds;
+    }
+    cube.add(t);
+    float left = data.rect_cube_end / 10.0F - cube.getValue();
+    if (left <= 0) {
+      return 0;
+    }
+    uint32_t v = meter.getProduct() - ref_product;
+    if (ref_cube == 0) {
+      ref_cube = cube.getValue();
+      ref_product = meter.getProduct();
+    } else if (v >= ETA_VOLUME_STEP) {
+      per_ml.add((cube.getValue() - ref_cube) / v);
+      ref_cube = cube.getValue();
+      ref_product = meter.getProduct();
+    }
+    uint32_t speed = static_cast<uint32_t>(nbk.getRealSpeedBody()) *
+                     (100 - nbk.getBodyTrim()) / 100;
+    if (nbk.getSelectionValveOpenTime() > 0 && speed > 0 &&
+        per_ml.getValue() > 0) {
+      return left / per_ml.getValue() * 3600 / speed;
+    }
+    if (cube.getSlope() > 0) {
+      return left / cube.getSlope() * 60;
+    }
+    return ETA_UNKNOWN;
+  }
+
+public:
+  void run() {
+    if (!next_update.tick(1000)) {
+      return;
+    }
+    Status s = nbk.getStatus();
+    if (s == OFF || s == END || s == MANUAL || s >= ERROR_TSA) {
+      reset();
+      return;
+    }
+    if (WITH_NBK && nbk.getMode() == NBK_MODE) {
+      seconds = feedLeft();
+    } else if (WITH_RECT && nbk.getMode() == RECT_MODE) {
+      seconds = cubeLeft();
+    }
+  }
+  uint32_t getSeconds() { return seconds; }
+  // ЧЧ:ММ до конца, --:-- если оценки нет
+  String getString() {
+    if (seconds == ETA_UNKNOWN) {
+      return "--:--";
+    }
+    uint32_t m = seconds / 60;
+    char b[6];
+    snprintf(b, sizeof(b), "%02u:%02u",
+             static_cast<unsigned>(m / 60 > 99 ? 99 : m / 60),
+             static_cast<unsigned>(m % 60));
+    return b;
+  }
+};
+Eta eta;
+enum Screen {
+  PUMP_SCREEN,
+  TEMPERATURES_SCREEN,
+  RECT_SCREEN,
+  TIME_SCREEN,
+  WATT_SCREEN,
+  EVENT_SCREEN,
+  ENERGY_SCREEN,
+  ABV_SCREEN
+};
 enum Select {
   NONE_SELECT,
   DATA_PUMP_SPEED,
@@ -1159,7 +2358,20 @@ enum Select {
   START_BODY_TEMP,
   FULL_TIME,
   SELECTION_VALVE_OPEN_TIME_SELECT,
-  WATT
+  WATT,
+  EVENT_LAST,
+  EVENT_PREVIOUS,
+  ENERGY_TOTAL,
+  ENERGY_PHASE,
+  ENERGY_PER_LITER,
+  ENERGY_VOLUME,
+  MASH,
+  ETA_TIME,
+  CUBE_ABV,
+  OUTPUT_ABV,
+  PRESSURE,
+  ABV_TAIL,
+  ABV_END
 };
 
 /*
@@ -1188,7 +2400,7 @@ struct Position {
   bool cursor;
   float last;
 };
-uint8_t POSITION_SIZE = 20;
+uint8_t POSITION_SIZE = 33;
 Position positions[] = {
     {NONE_SELECT, FLOAT_POSITION, "", "", 0, 0, 0, 0, false, 0},
 
@@ -1214,12 +2426,75 @@ Position positions[] = {
     {FULL_TIME, STRING_POSITION, "T:", "", 1, 1, 4, 3, false, 0},
     {SELECTION_VALVE_OPEN_TIME_SELECT, INT_POSITION, "SV:", "", 9, 1, 4, 3,
      false, 0},
-    {WATT, INT_POSITION, "W:", "", 1, 0, 4, 4, true, 0}};
+    {WATT, INT_POSITION, "W:", "", 1, 0, 4, 4, true, 0},
+    {MASH, INT_POSITION, "M:", "L", 9, 0, 3, 4, true, 0},
+    {ETA_TIME, STRING_POSITION, "ETA:", "", 1, 1, 5, 4, false, 0},
+
+    {EVENT_LAST, STRING_POSITION, "", "", 0, 0, 16, 5, false, 0},
+    {EVENT_PREVIOUS, STRING_POSITION, "", "", 0, 1, 16, 5, false, 0},
+
+    {ENERGY_TOTAL, STRING_POSITION, "E:", "", 0, 0, 6, 6, false, 0},
+    {ENERGY_PHASE, STRING_POSITION, "P:", "", 9, 0, 5, 6, false, 0},
+    {ENERGY_PER_LITER, STRING_POSITION, "", "kWh/L", 0, 1, 5, 6, false, 0},
+    {ENERGY_VOLUME, FLOAT_POSITION, "", "L", 11, 1, 4, 6, false, 0},
+
+    {CUBE_ABV, FLOAT_POSITION, "C:", "%", 0, 0, 4, 7, false, 0},
+    {OUTPUT_ABV, FLOAT_POSITION, "O:", "%", 8, 0, 4, 7, false, 0},
+    {PRESSURE, INT_POSITION, "P:", "", 1, 1, 3, 7, true, 0},
+    {ABV_TAIL, INT_POSITION, "T:", "", 7, 1, 2, 7, true, 0},
+    {ABV_END, INT_POSITION, "E:", "", 12, 1, 2, 7, true, 0}};
+// Настройки, которые правятся с экрана: позиция показывает и меняет регистр,
+// свой для НБК, ректификации и хвостов ректификации. Шаг в единицах
+// регистра, при удержании кнопки впятеро больше; границы и запись общие с
+// регистрами компьютера
+#define PARAM_READING 0x01 //без курсора позиция показывает измерение
+struct Param {
+  uint8_t select;
+  uint8_t nbk;
+  uint8_t rect;
+  uint8_t tail;
+  uint8_t scale; //делитель регистра для экрана
+  uint8_t step;
+  uint8_t flags;
+};
+const Param PARAMS[] PROGMEM = {
+    {BARD_TEMP, REG_NBK_BARD, REG_RECT_CUBE_TAIL, REG_RECT_CUBE_END, 10, 1,
+     PARAM_READING},
+    {OUTPUT_TEMP, REG_NBK_OUTPUT, REG_RECT_OUTPUT, REG_RECT_OUTPUT, 10, 1,
+     PARAM_READING},
+    {TSA_TEMP, REG_TSA, REG_TSA, REG_TSA, 10, 1, PARAM_READING},
+    {DELTA, REG_NBK_DELTA, REG_RECT_DELTA, REG_RECT_DELTA_TAIL, 10, 1, 0},
+    {SPEED_HEAD, REG_RECT_SPEED_HEAD, REG_RECT_SPEED_HEAD, REG_RECT_SPEED_HEAD,
+     1, 1, 0},
+    {SPEED_BODY, REG_RECT_SPEED_BODY, REG_RECT_SPEED_BODY, REG_RECT_SPEED_BODY,
+     1, 1, 0},
+    {SPEED_REDUCTION, REG_RECT_SPEED_REDUCTION, REG_RECT_SPEED_REDUCTION,
+     REG_RECT_SPEED_REDUCTION, 1, 1, 0},
+    {WATT, REG_NBK_WATT, REG_RECT_WATT, REG_RECT_WATT, 1, 1, 0},
+    {MASH, REG_NBK_MASH, REG_NBK_MASH, REG_NBK_MASH, 1, 1, 0},
+    {PRESSURE, REG_PRESSURE, REG_PRESSURE, REG_PRESSURE, 1, 1, 0},
+    {ABV_TAIL, REG_RECT_ABV_TAIL, REG_RECT_ABV_TAIL, REG_RECT_ABV_TAIL, 1, 1,
+     0},
+    {ABV_END, REG_RECT_ABV_END, REG_RECT_ABV_END, REG_RECT_ABV_END, 1, 1, 0}};
+#define PARAM_COUNT (sizeof(PARAMS) / sizeof(Param))
+
+// Запись настройки с экрана или с компьютера: проверка границ, пересчёт
+// отбора и отложенное сохранение
+bool writeRegister(uint8_t reg, uint16_t val) {
+  if (!setRegister(data, reg, val)) {
+    return false;
+  }
+  if (reg == REG_RECT_SPEED_BODY) {
+    nbk.updateSpeedBody();
+  }
+  eepromHandler.saveTask();
+  return true;
+}
 
 class Display {
 private:
   Screen screen = TEMPERATURES_SCREEN;
-  unsigned long next_update = 0;
+  Deadline next_update;
   float s = 0;
   float fs = 0;
   float c = 0;
@@ -1244,6 +2519,66 @@ private:
   uint16_t real_speed_body = 0;
   float start_body_temp = 0;
 
+  // Ч:ММ:СС от включения, код и данные события с конца журнала
+  String eventString(uint8_t back) {
+    if (back >= eventLog.size()) {
+      return "";
+    }
+    const Event &e = eventLog.get(eventLog.size() - 1 - back);
+    unsigned long t = e.getTime() + e.getTime() * 3 / 125; //*1.024
+    char code[3];
+    memcpy_P(code, EVENT_CODES[e.code < EVENT_COUNT ? e.code : 0],
+             sizeof(code));
+    char b[17];
+    snprintf(b, sizeof(b), "%lu:%02lu:%02lu %s %u %u", t / 3600, t / 60 % 60,
+             t % 60, code, e.a, e.b);
+    return b;
+  }
+  bool findParam(Select s, Param &param) {
+    for (uint8_t i = 0; i < PARAM_COUNT; i++) {
+      memcpy_P(&param, &PARAMS[i], sizeof(Param));
+      if (param.select == s) {
+        return true;
+      }
+    }
+    return false;
+  }
+  uint8_t paramRegister(const Param &param) {
+    if (nbk.getMode() == NBK_MODE) {
+      return param.nbk;
+    }
+    return nbk.getStatus() == TAIL ? param.tail : param.rect;
+  }
+  void stepParam(const Param &param, int i) {
+    uint8_t reg = paramRegister(param);
+    RegisterInfo r;
+    memcpy_P(&r, &REGISTERS[reg - PACKET_REGISTER], sizeof(RegisterInfo));
+    int32_t v = static_cast<int32_t>(getRegister(data, reg)) +
+                static_cast<int32_t>(i) * param.step;
+    writeRegister(reg, v < r.min ? r.min : v > r.max ? r.max : v);
+  }
+  void printValue(Position *p, float value, const String &stringValue,
+                  bool full) {
+    uint8_t c = p->col;
+    if (full) {
+      lcd.setCursor(c, p->row);
+      lcd.print(p->preffix);
+    }
+    c = c + p->preffix.length();
+    lcd.setCursor(c, p->row);
+    for (uint8_t i = 0; i < p->size; i++) {
+      lcd.print(' ');
+    }
+    lcd.setCursor(c, p->row);
+    if (p->p_type == STRING_POSITION || stringValue.length() > 0) {
+      lcd.print(stringValue);
+    } else {
+      lcd.print(String(value, static_cast<int>(p->p_type)));
+    }
+    if (p->ending.length() != 0) {
+      lcd.print(p->ending);
+    }
+  }
   float cutFloat(float f) {
     f *= 10;
     f = floor(f + 0.5);
@@ -1271,6 +2606,24 @@ public:
       }
       break;
     case TIME_SCREEN:
+      screen = WATT_SCREEN;
+      if (select != NONE_SELECT) {
+        select = NONE_SELECT;
+      }
+      break;
+    case WATT_SCREEN:
+      screen = EVENT_SCREEN;
+      if (select != NONE_SELECT) {
+        select = NONE_SELECT;
+      }
+      break;
+    case EVENT_SCREEN:
+      screen = ENERGY_SCREEN;
+      break;
+    case ENERGY_SCREEN:
+      screen = ABV_SCREEN;
+      break;
+    case ABV_SCREEN:
       screen = PUMP_SCREEN;
       if (select != NONE_SELECT) {
         select = NONE_SELECT;
@@ -1288,10 +2641,10 @@ public:
         unitPrint(positions[i].select_type, true);
       }
     }
-    next_update = millis() + 300;
+    next_update.start(300);
   }
   void update(bool f = false) {
-    if (f == false && next_update > millis()) {
+    if (f == false && !next_update.expired()) {
       return;
     }
     for (uint8_t i = 0; i < POSITION_SIZE; i++) {
@@ -1299,7 +2652,7 @@ public:
         unitPrint(positions[i].select_type, false, true);
       }
     }
-    next_update = millis() + 300;
+    next_update.start(300);
   }
   Position getPosition(Select s) {
     for (uint8_t i = 0; i < POSITION_SIZE; i++) {
@@ -1375,9 +2728,21 @@ public:
     float value = 0;
     String stringValue = "";
     Position *p = getPositionPointer(select);
+    Param param;
+    if (findParam(select, param) &&
+        (select == this->select || !(param.flags & PARAM_READING))) {
+      value = static_cast<float>(getRegister(data, paramRegister(param))) /
+              param.scale;
+      if (changed && p->last == value) {
+        return;
+      }
+      p->last = value;
+      printValue(p, value, stringValue, full);
+      return;
+    }
     switch (select) {
     case DATA_PUMP_SPEED:
-      value = data.pump_speed;
+      value = pump.getTarget();
       if (changed && p->last == value) {
         return;
       }
@@ -1398,7 +2763,7 @@ public:
       p->last = value;
       break;
     case COEFF_PUMP_AND_PWM:
-      stringValue = String(data.pump_coeff, 2) + "/" + String(pump.p);
+      stringValue = String(data.pump_coeff / 100.0F, 2) + "/" + String(pump.p);
       value = data.pump_coeff + pump.p;
       if (changed && p->last == value) {
         return;
@@ -1406,19 +2771,9 @@ public:
       p->last = value;
       break;
     case BARD_TEMP:
-      if (this->select != BARD_TEMP) {
-        value = temperature.getBardTemp();
-        if (value == 999) {
-          stringValue = ERR;
-        }
-      } else if (nbk.getMode() == NBK_MODE) {
-        value = data.nbk_bard;
-      } else if (nbk.getMode() == RECT_MODE) {
-        if (nbk.getStatus() != TAIL) {
-          value = data.rect_cube_tail;
-        } else {
-          value = data.rect_cube_end;
-        }
+      value = temperature.getBardTemp();
+      if (value == 999) {
+        stringValue = ERR;
       }
       if (changed && p->last == value) {
         return;
@@ -1426,15 +2781,9 @@ public:
       p->last = value;
       break;
     case OUTPUT_TEMP:
-      if (this->select != OUTPUT_TEMP) {
-        value = temperature.getOutputTemp();
-        if (value == 999) {
-          stringValue = ERR;
-        }
-      } else if (nbk.getMode() == NBK_MODE) {
-        value = data.nbk_output;
-      } else if (nbk.getMode() == RECT_MODE) {
-        value = data.rect_output;
+      value = temperature.getOutputTemp();
+      if (value == 999) {
+        stringValue = ERR;
       }
       if (changed && p->last == value) {
         return;
@@ -1442,13 +2791,9 @@ public:
       p->last = value;
       break;
     case TSA_TEMP:
-      if (this->select != TSA_TEMP) {
-        value = temperature.getTsaTemp();
-        if (value == 999) {
-          stringValue = ERR;
-        }
-      } else if (nbk.getMode() == NBK_MODE || nbk.getMode() == RECT_MODE) {
-        value = data.tsa;
+      value = temperature.getTsaTemp();
+      if (value == 999) {
+        stringValue = ERR;
       }
       if (changed && p->last == value) {
         return;
@@ -1469,116 +2814,113 @@ public:
       }
       p->last = static_cast<float>(nbk.getMode());
       break;
-    case DELTA:
-      if (nbk.getMode() == NBK_MODE) {
-        value = data.nbk_delta;
-      } else if (nbk.getMode() == RECT_MODE) {
-        if (nbk.getStatus() != TAIL) {
-          value = data.rect_delta;
-        } else {
-          value = data.rect_delta_tail;
-        }
-      }
+    case STABILIZATION_TIME:
+      value = nbk.getStabilizationRestTime();
       if (changed && p->last == value) {
         return;
       }
-      p->last = value;
+      p->last = nbk.getStabilizationRestTime();
       break;
-    case SPEED_HEAD:
-      value = data.rect_speed_head;
+    case REAL_SPEED_BODY:
+      value = nbk.getRealSpeedBody();
       if (changed && p->last == value) {
         return;
       }
       p->last = value;
       break;
-    case SPEED_BODY:
-      value = data.rect_speed_body;
+    case START_BODY_TEMP:
+      value = nbk.getStartBodyTemp();
       if (changed && p->last == value) {
         return;
       }
       p->last = value;
       break;
-    case SPEED_REDUCTION:
-      value = data.rect_speed_reduction;
+    case FULL_TIME:
+      stringValue = time.getTime();
+      if (changed && p->last == time.getMinutes()) {
+        return;
+      }
+      p->last = time.getMinutes();
+      break;
+    case SELECTION_VALVE_OPEN_TIME_SELECT:
+      value = nbk.getSelectionValveOpenTime();
       if (changed && p->last == value) {
         return;
       }
       p->last = value;
       break;
-    case STABILIZATION_TIME:
-      value = nbk.getStabilizationRestTime();
-      if (changed && p->last == value) {
+    case EVENT_LAST:
+    case EVENT_PREVIOUS:
+      stringValue = eventString(select == EVENT_LAST ? 0 : 1);
+      if (changed && p->last == eventLog.getTotal()) {
         return;
       }
-      p->last = nbk.getStabilizationRestTime();
+      p->last = eventLog.getTotal();
       break;
-    case REAL_SPEED_BODY:
-      value = nbk.getRealSpeedBody();
-      if (changed && p->last == value) {
+    case ENERGY_TOTAL:
+      stringValue = String(meter.getWh() / 1000.0, 2);
+      if (changed && p->last == meter.getWh()) {
         return;
       }
-      p->last = value;
+      p->last = meter.getWh();
       break;
-    case START_BODY_TEMP:
-      value = nbk.getStartBodyTemp();
+    case ENERGY_PHASE:
+      value = meter.getPhaseWh(nbk.getStatus());
+      stringValue = String(value / 1000, 2);
       if (changed && p->last == value) {
         return;
       }
       p->last = value;
       break;
-    case FULL_TIME:
-      stringValue = time.getTime();
-      if (changed && p->last == time.getLastUpdate()) {
+    case ENERGY_PER_LITER:
+      value = meter.getWhPerLiter(nbk.getMode());
+      stringValue = String(value / 1000, 3);
+      if (changed && p->last == value) {
         return;
       }
-      p->last = time.getLastUpdate();
+      p->last = value;
       break;
-    case SELECTION_VALVE_OPEN_TIME_SELECT:
-      value = nbk.getSelectionValveOpenTime();
+    case ENERGY_VOLUME:
+      value = meter.getVolume(nbk.getMode()) / 100 / 10.0;
       if (changed && p->last == value) {
         return;
       }
       p->last = value;
       break;
-    case WATT:
-      if (nbk.getMode() == NBK_MODE) {
-        value = data.nbk_watt;
-      } else if (nbk.getMode() == RECT_MODE) {
-        value = data.rect_watt;
+    case CUBE_ABV:
+    case OUTPUT_ABV:
+      value = !WITH_RECT          ? ABV_UNKNOWN
+              : select == CUBE_ABV ? strength.getCubeAbv()
+                                   : strength.getOutputAbv();
+      if (value == ABV_UNKNOWN) {
+        stringValue = ERR;
       }
       if (changed && p->last == value) {
         return;
       }
       p->last = value;
       break;
+    case ETA_TIME:
+      stringValue = eta.getString();
+      if (changed && p->last == eta.getSeconds() / 60) {
+        return;
+      }
+      p->last = eta.getSeconds() / 60;
+      break;
     default:
       return;
     }
-    uint8_t c = p->col;
-    if (full) {
-      lcd.setCursor(c, p->row);
-      lcd.print(p->preffix);
-    }
-    c = c + p->preffix.length();
-    lcd.setCursor(c, p->row);
-    for (uint8_t i = 0; i < p->size; i++) {
-      lcd.print(' ');
-    }
-    lcd.setCursor(c, p->row);
-    if (p->p_type == STRING_POSITION || stringValue.length() > 0) {
-      lcd.print(stringValue);
-    } else {
-      lcd.print(String(value, static_cast<int>(p->p_type)));
-    }
-    if (p->ending.length() != 0) {
-      lcd.print(p->ending);
-    }
+    printValue(p, value, stringValue, full);
   }
   void updateSelect(bool next) {
     Position from = getPosition(select);
     removeCursor();
     Position p = getNextPosition(from, next);
     select = p.select_type;
+    // поле без курсора снова показывает измерение
+    if (from.select_type != NONE_SELECT) {
+      unitPrint(from.select_type);
+    }
     if (select == NONE_SELECT) {
       return;
     }
@@ -1594,73 +2936,25 @@ public:
   void removeCursor() { updateCursor(true); }
   void printCursor() { updateCursor(false); }
 
-  void changeSelectValue(int l, bool up) {
+  void changeSelectValue(bool fast, bool up) {
     if (select == NONE_SELECT) {
       return;
     }
-    float f = l > 0 ? 0.5 : 0.1;
-    int i = l > 0 ? 5 : 1;
+    float f = fast ? 0.5 : 0.1;
+    int i = fast ? 5 : 1;
     if (up == false) {
       f = -f;
       i = -i;
     }
+    Param param;
+    uint16_t v;
     switch (select) {
-    case BARD_TEMP:
-      if (nbk.getMode() == NBK_MODE) {
-        data.nbk_bard = data.nbk_bard + f;
-      } else if (nbk.getMode() == RECT_MODE) {
-        if (nbk.getStatus() == TAIL) {
-          data.rect_cube_end = data.rect_cube_end + f;
-        } else {
-          data.rect_cube_tail = data.rect_cube_tail + f;
-        }
-      }
-      eepromHandler.saveTask();
-      // updateSelect();
-      break;
-    case OUTPUT_TEMP:
-      if (nbk.getMode() == NBK_MODE) {
-        data.nbk_output = data.nbk_output + f;
-      } else if (nbk.getMode() == RECT_MODE) {
-        data.rect_output = data.rect_output + f;
-      }
-      eepromHandler.saveTask();
-      break;
-    case TSA_TEMP:
-      data.tsa = data.tsa + f;
-      eepromHandler.saveTask();
-      break;
     case STATUS:
       up ? nbk.nextStatus() : nbk.backStatus();
       break;
     case MODE:
       up ? nbk.nextMode() : nbk.backMode();
       break;
-    case DELTA:
-      if (nbk.getMode() == NBK_MODE) {
-        data.nbk_delta = data.nbk_delta + f;
-      } else if (nbk.getMode() == RECT_MODE) {
-        if (nbk.getStatus() != TAIL) {
-          data.rect_delta = data.rect_delta + f;
-        } else {
-          data.rect_delta_tail = data.rect_delta_tail + f;
-        }
-      }
-      eepromHandler.saveTask();
-      break;
-    case SPEED_HEAD:
-      data.rect_speed_head = data.rect_speed_head + i;
-      eepromHandler.saveTask();
-      break;
-    case SPEED_BODY:
-      data.rect_speed_body = data.rect_speed_body + i;
-      nbk.updateSpeedBody();
-      eepromHandler.saveTask();
-      break;
-    case SPEED_REDUCTION:
-      data.rect_speed_reduction = data.rect_speed_reduction + i;
-      eepromHandler.saveTask();
-      break;
     case STABILIZATION_TIME:
       nbk.setStabilizationRestTime(nbk.getStabilizationRestTime() + i);
       break;
@@ -1670,17 +2964,21 @@ public:
     case START_BODY_TEMP:
       nbk.setStartBodyTemp(nbk.getStartBodyTemp() + f);
       break;
-    case WATT:
-      if (nbk.getMode() == NBK_MODE) {
-        data.nbk_watt += i;
-      } else if (nbk.getMode() == RECT_MODE) {
-        data.rect_watt += i;
+    case PRESSURE:
+      // с нуля (без поправки) сразу к нормальному давлению
+      v = data.pressure == 0 ? VLE_NORMAL : data.pressure + i;
+      if (v < VLE_NORMAL - 160 || v > VLE_NORMAL + 60) {
+        v = 0;
       }
-      eepromHandler.saveTask();
+      writeRegister(REG_PRESSURE, v);
+      break;
     default:
-      return;
+      if (!findParam(select, param)) {
+        return;
+      }
+      stepParam(param, i);
     }
-    update(true);
+    unitPrint(select);
   }
 };
 Display display;
@@ -1694,26 +2992,63 @@ enum Button {
   NONE = 9
 };
 
+enum KeyType { KEY_PRESS, KEY_REPEAT, KEY_LONG };
+struct KeyEvent {
+  uint8_t button;
+  uint8_t type;
+};
+
+// Опрос кнопок будит прерывание смены уровня. Пока кнопка нажата или
+// дребезжит, уровни читаются из порта раз в KEYBOARD_SAMPLE мс через
+// интегратор; нажатия и повторы с ускорением копятся в очереди и
+// разбираются в loop
 class Keyboard {
 private:
   unsigned long delay = 500;
-  unsigned long update = 50;
   uint8_t switch_speed = 30;
-  unsigned long next_update = 0;
-  unsigned long nextPress = 0;
-  unsigned int l;
+  volatile bool wake = true;
+  bool busy = false;
+  volatile uint8_t *ports[BUTTON_COUNT];
+  uint8_t masks[BUTTON_COUNT];
+  uint8_t level[BUTTON_COUNT] = {};
+  uint8_t down = 0; //биты устоявшихся нажатий
+  Deadline next_sample;
+  Deadline nextPress;
+  unsigned int l = 0;
+  KeyEvent queue[KEYBOARD_QUEUE];
+  uint8_t head = 0;
+  uint8_t count = 0;
 
   Button lastButton = NONE;
 
+  // false - все кнопки отпущены и успокоились
+  bool sample() {
+    bool settling = false;
+    for (uint8_t i = 0; i < BUTTON_COUNT; i++) {
+      if (!(*ports[i] & masks[i])) {
+        if (level[i] < KEYBOARD_DEBOUNCE && ++level[i] == KEYBOARD_DEBOUNCE) {
+          down |= 1 << i;
+        }
+      } else if (level[i] > 0 && --level[i] == 0) {
+        down &= ~(1 << i);
+      }
+      settling |= level[i] > 0;
+    }
+    return settling;
+  }
+
   Button getPressedButton() {
-    for (uint8_t i = 0; i < 5; i++) {
-      if (digitalRead(keyboard_pins[i]) == LOW) {
+    for (uint8_t i = 0; i < BUTTON_COUNT; i++) {
+      if (down & (1 << i)) {
         return static_cast<Button>(i);
       }
     }
     return NONE;
   }
 
+  // Автоповтор как раньше: 500 мс, 250, 100, затем 50 мс. Крупный шаг
+  // (KEY_LONG) - только после switch_speed повторов, и на экране насоса, и
+  // в настройках
   void calculateDelay(Button button) {
     if (button != lastButton) {
       l = 0;
@@ -1721,43 +3056,73 @@ private:
       l++;
     }
     if (l < 3) {
-      nextPress = millis() + delay;
+      nextPress.start(delay);
     } else if (l < 5) {
-      nextPress = millis() + (delay / 2);
+      nextPress.start(delay / 2);
     } else if (l < 20) {
-      nextPress = millis() + (delay / 5);
-    } else if (l < switch_speed) {
-      nextPress = millis() + (delay / 10);
+      nextPress.start(delay / 5);
+    } else {
+      nextPress.start(delay / 10);
+    }
+  }
+  void push(Button button, KeyType type) {
+    if (count == KEYBOARD_QUEUE) {
+      return;
     }
+    KeyEvent &e = queue[(head + count) & (KEYBOARD_QUEUE - 1)];
+    e.button = button;
+    e.type = type;
+    count++;
   }
-  void pressButton(Button button) {
+  void scan() {
+    Button button = getPressedButton();
+    if (button == NONE) {
+      lastButton = NONE;
+      l = 0;
+      return;
+    }
+    if (button != lastButton || nextPress.expired()) {
+      calculateDelay(button);
+      lastButton = button;
+      push(button, l == 0             ? KEY_PRESS
+                   : l > switch_speed ? KEY_LONG
+                                      : KEY_REPEAT);
+    }
+  }
+  void pressButton(const KeyEvent &e) {
+    bool fast = e.type == KEY_LONG;
     if (buzzer.isEnabled()) {
       buzzer.setEnabled(false);
       buzzer.setBuzzerType(BuzzerType::BUZZER_NONE);
     }
     buzzer.sing(BUZZER_BUTTON);
-    switch (button) {
+    switch (e.button) {
     case UP:
       if (display.getScreen() == PUMP_SCREEN) {
         if (pump.manual) {
-          pump.p = l > switch_speed ? pump.p + 5 : pump.p + 1;
+          pump.p = fast ? pump.p + 5 : pump.p + 1;
           if (pump.p > PWM_MAX) {
             pump.p = PWM_MAX;
           }
           pump.pwm();
+        } else if (WITH_NBK && nbk.getStatus() == PROCESS) {
+          feed.adjust(Q16::ratio(fast ? 50 : 10, 100));
+          pump.setTarget(feed.getSpeed());
         } else {
-          data.pump_speed =
-              l > switch_speed ? data.pump_speed + 0.5 : data.pump_speed + 0.1;
-          eepromHandler.saveTask();
+          writeRegister(REG_PUMP_SPEED,
+                        data.pump_speed + (fast ? 50 : 10));
+          pump.setTarget(data.pump_speed / 100.0F);
+          eventLog.add16(EVENT_FEED, data.pump_speed);
         }
+        display.unitPrint(pump.manual ? COEFF_PUMP_AND_PWM : DATA_PUMP_SPEED);
       } else {
-        display.changeSelectValue(l - switch_speed, true);
+        display.changeSelectValue(fast, true);
       }
       break;
     case DOWN:
       if (display.getScreen() == PUMP_SCREEN) {
         if (pump.manual) {
-          if (l > switch_speed) {
+          if (fast) {
             if (pump.p < 5) {
               pump.p = 0;
             } else {
@@ -1769,16 +3134,18 @@ private:
             }
           }
           pump.pwm();
+        } else if (WITH_NBK && nbk.getStatus() == PROCESS) {
+          feed.adjust(Q16::ratio(fast ? -50 : -10, 100));
+          pump.setTarget(feed.getSpeed());
         } else {
-          data.pump_speed =
-              l > switch_speed ? data.pump_speed - 0.5 : data.pump_speed - 0.1;
-          if (data.pump_speed < 0) {
-            data.pump_speed = 0;
-          }
-          eepromHandler.saveTask();
+          int16_t v = data.pump_speed - (fast ? 50 : 10);
+          writeRegister(REG_PUMP_SPEED, v < 0 ? 0 : v);
+          pump.setTarget(data.pump_speed / 100.0F);
+          eventLog.add16(EVENT_FEED, data.pump_speed);
         }
+        display.unitPrint(pump.manual ? COEFF_PUMP_AND_PWM : DATA_PUMP_SPEED);
       } else {
-        display.changeSelectValue(l - switch_speed, false);
+        display.changeSelectValue(fast, false);
       }
       break;
     case RIGHT:
@@ -1790,13 +3157,14 @@ private:
       break;
     case LEFT:
       if (display.getScreen() == PUMP_SCREEN) {
-        if (!pump.calibration && l > switch_speed) {
+        if (!pump.calibration && fast) {
           pump.calibrate();
           l = 0;
-          nextPress = millis() + 2000;
+          nextPress.start(2000);
         } else if (pump.calibration) {
           pump.calibrate();
           eepromHandler.saveTask();
+          display.unitPrint(COEFF_PUMP_AND_PWM);
         }
       } else {
         display.backSelect();
@@ -1812,50 +3180,366 @@ private:
   }
 
 public:
+  void setup() {
+    for (uint8_t i = 0; i < BUTTON_COUNT; i++) {
+      uint8_t pin = keyboard_pins[i];
+      pinMode(pin, INPUT_PULLUP);
+      ports[i] = portInputRegister(digitalPinToPort(pin));
+      masks[i] = digitalPinToBitMask(pin);
+      *digitalPinToPCMSK(pin) |= _BV(digitalPinToPCMSKbit(pin));
+      *digitalPinToPCICR(pin) |= _BV(digitalPinToPCICRbit(pin));
+    }
+  }
+  // из прерывания
+  void wakeUp() { wake = true; }
   void run() {
-    if (next_update > millis()) {
+    if (wake) {
+      wake = false;
+      busy = true;
+    }
+    if (busy && next_sample.tick(KEYBOARD_SAMPLE)) {
+      busy = sample();
+      scan();
+    }
+    while (count > 0) {
+      KeyEvent e = queue[head];
+      head = (head + 1) & (KEYBOARD_QUEUE - 1);
+      count--;
+      pressButton(e);
+    }
+  }
+
+  bool isPressed() { return lastButton != NONE; }
+};
+
+Keyboard keyboard;
+// Кнопки 4-7 на порту D, 8 на порту B
+ISR(PCINT2_vect) { keyboard.wakeUp(); }
+ISR(PCINT0_vect, ISR_ALIASOF(PCINT2_vect));
+
+class Remote {
+private:
+  Deadline next_telemetry;
+  Packet in;
+  Packet out;
+  Telemetry telemetry;
+  bool broadcast = false;
+
+  int32_t round10(float f) { return static_cast<int32_t>(floor(f * 10 + 0.5F)); }
+
+  void sendTelemetry() {
+    int32_t v[TELEMETRY_FIELDS];
+    v[TM_BARD_TEMP] = round10(temperature.getBardTemp());
+    v[TM_OUTPUT_TEMP] = round10(temperature.getOutputTemp());
+    v[TM_TSA_TEMP] = round10(temperature.getTsaTemp());
+    v[TM_PUMP_SPEED] = static_cast<int32_t>(pump.getTarget() * 100 + 0.5F);
+    v[TM_REAL_PUMP_SPEED] = static_cast<int32_t>(pump.getSpeed() * 100 + 0.5F);
+    v[TM_PUMP_PWM] = pump.p;
+    v[TM_LITERS] = round10(pump.getLiters());
+    v[TM_STATUS] = nbk.getStatus();
+    v[TM_MODE] = nbk.getMode();
+    v[TM_VALVE_OPEN_TIME] = nbk.getSelectionValveOpenTime();
+    v[TM_REAL_SPEED_BODY] = nbk.getRealSpeedBody();
+    v[TM_POWER] = heater.getPower();
+    v[TM_ENERGY] = meter.getWh();
+    v[TM_PRODUCT] = meter.getProduct();
+    v[TM_ETA] = eta.getSeconds() == ETA_UNKNOWN ? -1 : eta.getSeconds();
+    uint8_t n = telemetry.encode(v, out.getBuffer(), PACKET_PAYLOAD_SIZE);
+    if (n == 0) {
       return;
     }
-    next_update = millis() + update;
-    Button button = getPressedButton();
-    if (button == NONE && lastButton != NONE) {
-      lastButton = NONE;
-      l = 0;
+    out.init(PACKET_TELEMETRY, n);
+    send();
+  }
+
+  bool isBus() { return data.node_address != ADDRESS_NONE; }
+
+  // На шине передатчик включается только на время ответа
+  void send() {
+    if (broadcast) {
       return;
     }
-    if (button == NONE) {
+    out.setAddress(data.node_address | ADDRESS_REPLY);
+    out.fill();
+    if (isBus()) {
+      Rs485Pin::high();
+      out.send();
+      Serial.flush();
+      Rs485Pin::low();
+    } else {
+      out.send();
+    }
+  }
+
+  void nack(uint8_t id, NackCode code) {
+    uint8_t b[] = {id, static_cast<uint8_t>(code)};
+    out.init(PACKET_NACK, b, sizeof(b));
+    send();
+  }
+
+  uint16_t getControl(uint8_t reg) {
+    switch (reg) {
+    case REG_STATUS:
+      return nbk.getStatus();
+    case REG_MODE:
+      return nbk.getMode();
+    case REG_REAL_SPEED_BODY:
+      return nbk.getRealSpeedBody();
+    case REG_PUMP_MANUAL:
+      return pump.manual;
+    case REG_PUMP_PWM:
+      return pump.p;
+    case REG_FEED_MAX:
+      return WITH_NBK ? feed.learned(data.nbk_watt) * 100 : 0;
+    case REG_BODY_TRIM:
+      return nbk.getBodyTrim();
+    case REG_OVERCLOCK_TIME:
+      return overclock.read(nbk.getMode()).time;
+    case REG_OVERCLOCK_LEAD:
+      return overclock.read(nbk.getMode()).lead;
+    case REG_INTERLOCK_REACTION:
+      return interlock.getReaction();
+    case REG_LOOP_MAX:
+      return interlock.getPassMax();
+    case REG_ENERGY:
+      return meter.getWh() > 0xFFFF ? 0xFFFF : meter.getWh();
+    case REG_ENERGY_PER_LITER:
+      return meter.getWhPerLiter(nbk.getMode());
+    case REG_PRODUCT:
+      return meter.getProduct() > 0xFFFF ? 0xFFFF : meter.getProduct();
+    case REG_CUBE_ABV:
+      return (WITH_RECT ? strength.getCubeAbv() : ABV_UNKNOWN) * 10 + 0.5;
+    case REG_OUTPUT_ABV:
+      return (WITH_RECT ? strength.getOutputAbv() : ABV_UNKNOWN) * 10 + 0.5;
+    case REG_ETA:
+      return eta.getSeconds() / 60 > 0xFFFF ? 0xFFFF : eta.getSeconds() / 60;
+    default:
+      return 0;
+    }
+  }
+
+  bool setControl(uint8_t reg, uint16_t val) {
+    switch (reg) {
+    case REG_STATUS:
+      //из сработавшей защиты выводят только с пульта
+      if (val >= STATUS_COUNT || interlock.isTripped()) {
+        return false;
+      }
+      return nbk.setStatus(static_cast<Status>(val));
+    case REG_MODE:
+      if (val >= MODE_COUNT) {
+        return false;
+      }
+      return nbk.setMode(static_cast<Mode>(val));
+    case REG_REAL_SPEED_BODY:
+      if (val > SELECTION_VALVE_COEFF) {
+        return false;
+      }
+      nbk.setRealSpeedBody(val);
+      return true;
+    case REG_PUMP_MANUAL:
+      if (val > 1) {
+        return false;
+      }
+      pump.manual = val;
+      return true;
+    case REG_PUMP_PWM:
+      if (val > PWM_MAX) {
+        return false;
+      }
+      pump.p = val;
+      pump.pwm();
+      return true;
+    case REG_FEED_MAX:
+      if (!WITH_NBK || val > 5000) {
+        return false;
+      }
+      feed.record(data.nbk_watt, static_cast<float>(val) / 100);
+      return true;
+    case REG_OVERCLOCK_LEAD:
+      if (val == 0 || val > OVERCLOCK_LEAD_MAX) {
+        return false;
+      }
+      overclock.setLead(nbk.getMode(), val);
+      return true;
+    case REG_LOOP_MAX:
+      interlock.clearPassMax();
+      return true;
+    case REG_ENERGY:
+      meter.reset();
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  void handleRegister() {
+    uint8_t reg = in.getId();
+    if (in.getLength() != 0 && in.getLength() != sizeof(uint16_t)) {
+      nack(reg, NACK_LENGTH);
       return;
     }
-    if (button != lastButton || nextPress < millis()) {
-      lastButton = button;
-      calculateDelay(button);
-      pressButton(button);
-      display.update(true);
+    bool ok = true;
+    if (in.getLength() != 0) {
+      if (reg < REG_DATA_END) {
+        ok = writeRegister(reg, in.getVal());
+      } else {
+        ok = setControl(reg, in.getVal());
+      }
+    }
+    if (!ok) {
+      nack(reg, NACK_RANGE);
       return;
     }
+    out.init(reg, reg < REG_DATA_END ? getRegister(data, reg) : getControl(reg));
+    send();
   }
 
-  bool isPressed() { return lastButton != NONE; }
-};
+  // Весь образ проверяется до применения; адреса датчиков остаются свои
+  void blockWrite() {
+    Data d;
+    if (in.getLength() != sizeof(Data)) {
+      nack(PACKET_BLOCK_WRITE, NACK_LENGTH);
+      return;
+    }
+    memcpy(&d, in.getPayload(), sizeof(Data));
+    if (d.version != dataVersion) {
+      nack(PACKET_BLOCK_WRITE, NACK_VERSION);
+      return;
+    }
+    for (uint8_t r = PACKET_REGISTER; r < REG_DATA_END; r++) {
+      if (!setRegister(d, r, getRegister(d, r))) {
+        nack(r, NACK_RANGE);
+        return;
+      }
+    }
+    copy(data.tsa_addr, d.tsa_addr);
+    copy(data.bard_addr, d.bard_addr);
+    copy(data.output_addr, d.output_addr);
+    data = d;
+    nbk.updateSpeedBody();
+    eepromHandler.saveTask();
+    blockRead(PACKET_BLOCK_WRITE);
+  }
 
-Keyboard keyboard;
+  void blockRead(uint8_t id) {
+    out.init(id, reinterpret_cast<const uint8_t *>(&data), sizeof(Data));
+    send();
+  }
+
+  bool accept() {
+    uint8_t a = in.getAddress();
+    if (a & ADDRESS_REPLY) {
+      return false;
+    }
+    broadcast = a == ADDRESS_BROADCAST;
+    return !isBus() || broadcast || a == data.node_address;
+  }
+
+  void handle() {
+    uint8_t id = in.getId();
+    if (id >= PACKET_REGISTER && id < REG_END) {
+      handleRegister();
+      return;
+    }
+    switch (id) {
+    case PACKET_TELEMETRY:
+      if (in.getLength() > 0 && (in.getPayload()[0] & TELEMETRY_KEY)) {
+        telemetry.reset();
+      }
+      sendTelemetry();
+      break;
+    case PACKET_BLOCK_READ:
+      blockRead(PACKET_BLOCK_READ);
+      break;
+    case PACKET_BLOCK_WRITE:
+      blockWrite();
+      break;
+    case PACKET_EVENTS:
+      out.init(PACKET_EVENTS,
+               eventLog.copy(out.getBuffer(),
+                             in.getLength() > 0 && in.getPayload()[0] != 0));
+      send();
+      break;
+    case PACKET_SAVE:
+      eepromHandler.commit();
+      out.init(PACKET_SAVE, nullptr, 0);
+      send();
+      break;
+    default:
+      nack(id, NACK_UNKNOWN);
+      break;
+    }
+  }
+
+public:
+  void setup() {
+    Rs485Pin::output();
+    Rs485Pin::low();
+    Serial.begin(SERIAL_SPEED);
+    telemetry.setRate(TM_TSA_TEMP, 5);
+    telemetry.setRate(TM_PUMP_PWM, 2);
+    telemetry.setRate(TM_LITERS, 5);
+  }
+  void run() {
+    while (in.avaible()) {
+      if (accept()) {
+        handle();
+      }
+    }
+    broadcast = false;
+    if (isBus() || !next_telemetry.tick(TELEMETRY_TIME)) {
+      return;
+    }
+    sendTelemetry();
+  }
+  Telemetry &getTelemetry() { return telemetry; }
+};
+Remote remote;
 void pulse() { pump.pulse(); }
 
+// Зависший loop: через 2 с прерывание сторожевого таймера выключает тэны и
+// клапан отбора, ещё через 2 с контроллер перезагружается. Аппаратура
+// снимает WDIE при входе в прерывание; если loop ожил, он приводит Relay в
+// соответствие с выводами и снова включает прерывание
+volatile bool watchdog_cut = false;
+ISR(WDT_vect) {
+  Pin<TENG_ONE_PIN>::high();
+  Pin<TENG_TWO_PIN>::high();
+  Pin<SELECTION_VALVE_PIN>::low();
+  watchdog_cut = true;
+}
+void watchdogRecover() {
+  if (!watchdog_cut) {
+    return;
+  }
+  watchdog_cut = false;
+  heater.stop();
+  relay.closeSelectionValve();
+  eventLog.add(EVENT_WATCHDOG);
+  WDTCSR |= _BV(WDIE);
+}
+void watchdogSetup() {
+  cli();
+  wdt_reset();
+  WDTCSR = (1 << WDCE) | (1 << WDE);
+  WDTCSR = (1 << WDIE) | (1 << WDE) | (1 << WDP2) | (1 << WDP1) | (1 << WDP0);
+  sei();
+}
 void setup() {
+  uint8_t reset_cause = MCUSR;
+  MCUSR = 0;
+  wdt_disable();
+  eventLog.add(EVENT_BOOT, reset_cause);
   lcd.init();
   lcd.backlight();
   lcd.clear();
-  pinMode(MOSFET_PIN, OUTPUT);
-  pinMode(SELECTION_VALVE_PIN, OUTPUT);
-  pinMode(BUZZER_PIN, OUTPUT);
-  pinMode(TENG_ONE_PIN, OUTPUT);
-  pinMode(TENG_TWO_PIN, OUTPUT);
-  pinMode(FLOW_PIN, INPUT);
+  MosfetPin::output();
+  Pin<BUZZER_PIN>::output();
+  Pin<FLOW_PIN>::input();
   attachInterrupt(digitalPinToInterrupt(FLOW_PIN), pulse, RISING);
   sei();
-  for (uint8_t i = 0; i < 5; i++) {
-    pinMode(keyboard_pins[i], INPUT_PULLUP);
-  }
+  keyboard.setup();
   for (uint8_t i = 0; i < PUMP_CONTROL_SECOND; i++) {
     tick[i] = 0;
   }
@@ -1867,21 +3551,34 @@ void setup() {
   pump.pwm();
   relay.setup();
   temperature.setup();
+  remote.setup();
   delay(3000);
   display.print();
+  watchdogSetup();
 }
 
 void loop() {
+  unsigned long pass = millis();
+  wdt_reset();
+  watchdogRecover();
+  if (temperature.read()) {
+    interlock.check(temperature.getTsaTemp(), temperature.getRequestTime());
+  }
   keyboard.run();
   pump.writePulses();
   if (!pump.manual) {
     pump.calculate();
   }
   display.update();
-  temperature.read();
   nbk.run();
+  meter.run();
+  eta.run();
   nbk.selectionValveCheck();
+  heater.run();
   buzzer.sing();
   eepromHandler.check();
-  time.getTime();
+  time.run();
+  eventLog.run();
+  remote.run();
+  interlock.pass(millis() - pass);
 }
\ No newline at end of file
@@ -0,0 +1,279 @@
+#ifndef archive_h
+#define archive_h
+
+// Архив одного запуска колонны. Файл только дописывается и отображается в
+// память: заголовок с настройками Data и индексом блоков, затем блоки по
+// ARCHIVE_BLOCK_ROWS строк. В блоке лежат столбцы: время (мс от начала
+// запуска, uint32) и по столбцу int32 на каждое поле телеметрии.
+
+#include <Packet.h>
+#include <Telemetry.h>
+#include <algorithm>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ARCHIVE_MAGIC "DISTRUN1"
+#define ARCHIVE_VERSION 2
+#define ARCHIVE_SETTINGS_SIZE 256
+#define ARCHIVE_BLOCK_ROWS 1024
+#define ARCHIVE_MAX_BLOCKS 1024
+#define ARCHIVE_PAGE 4096
+
+struct ArchiveIndex {
+  uint32_t first; //время первой строки блока, мс
+  uint32_t last;  //время последней строки блока, мс
+};
+
+struct ArchiveHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t signals;
+  uint32_t block_rows;
+  uint32_t max_blocks;
+  uint32_t rows;
+  uint32_t closed;
+  int64_t start; //unix время начала запуска, мс
+  uint8_t node;
+  uint8_t reserved[5];
+  uint16_t settings_length;
+  uint8_t settings[ARCHIVE_SETTINGS_SIZE];
+  ArchiveIndex index[ARCHIVE_MAX_BLOCKS];
+};
+
+inline size_t archiveDataOffset() {
+  return (sizeof(ArchiveHeader) + ARCHIVE_PAGE - 1) / ARCHIVE_PAGE *
+         ARCHIVE_PAGE;
+}
+
+inline size_t archiveBlockSize(uint32_t signals) {
+  return static_cast<size_t>(ARCHIVE_BLOCK_ROWS) * sizeof(uint32_t) *
+         (signals + 1);
+}
+
+class ArchiveWriter {
+private:
+  int fd = -1;
+  ArchiveHeader *header = nullptr;
+  uint8_t *block = nullptr;
+  uint32_t block_number = 0;
+
+  bool mapBlock(uint32_t b) {
+    size_t size = archiveBlockSize(header->signals);
+    if (block != nullptr) {
+      munmap(block, size);
+      block = nullptr;
+    }
+    off_t offset = archiveDataOffset() + static_cast<off_t>(b) * size;
+    if (ftruncate(fd, offset + size) != 0) {
+      return false;
+    }
+    void *m = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                   offset);
+    if (m == MAP_FAILED) {
+      return false;
+    }
+    block = static_cast<uint8_t *>(m);
+    block_number = b;
+    return true;
+  }
+
+public:
+  ~ArchiveWriter() { close(); }
+
+  bool isOpen() { return header != nullptr; }
+
+  bool create(const char *path, int64_t start, uint8_t node,
+              const uint8_t *settings, uint16_t length) {
+    fd = ::open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+      return false;
+    }
+    if (ftruncate(fd, archiveDataOffset()) != 0) {
+      close();
+      return false;
+    }
+    void *m = mmap(nullptr, archiveDataOffset(), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED) {
+      close();
+      return false;
+    }
+    header = static_cast<ArchiveHeader *>(m);
+    memcpy(header->magic, ARCHIVE_MAGIC, sizeof(header->magic));
+    header->version = ARCHIVE_VERSION;
+    header->signals = TELEMETRY_FIELDS;
+    header->block_rows = ARCHIVE_BLOCK_ROWS;
+    header->max_blocks = ARCHIVE_MAX_BLOCKS;
+    header->start = start;
+    header->node = node;
+    if (length > ARCHIVE_SETTINGS_SIZE) {
+      length = ARCHIVE_SETTINGS_SIZE;
+    }
+    header->settings_length = length;
+    if (length > 0) {
+      memcpy(header->settings, settings, length);
+    }
+    return mapBlock(0);
+  }
+
+  bool isFull() {
+    return header->rows >= header->max_blocks * header->block_rows;
+  }
+
+  // Строка сначала пишется в блок, потом учитывается в заголовке;
+  // счётчик публикуется с release, читатель берёт его с acquire
+  bool append(uint32_t time, const int32_t *values) {
+    if (header == nullptr || isFull()) {
+      return false;
+    }
+    uint32_t b = header->rows / header->block_rows;
+    uint32_t r = header->rows % header->block_rows;
+    if (b != block_number && !mapBlock(b)) {
+      return false;
+    }
+    uint32_t *t = reinterpret_cast<uint32_t *>(block);
+    t[r] = time;
+    int32_t *v = reinterpret_cast<int32_t *>(t + header->block_rows);
+    for (uint32_t s = 0; s < header->signals; s++) {
+      v[s * header->block_rows + r] = values[s];
+    }
+    if (r == 0) {
+      header->index[b].first = time;
+    }
+    header->index[b].last = time;
+    __atomic_store_n(&header->rows, header->rows + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  void sync() {
+    if (header != nullptr) {
+      msync(block, archiveBlockSize(header->signals), MS_ASYNC);
+      msync(header, archiveDataOffset(), MS_ASYNC);
+    }
+  }
+
+  void close() {
+    if (header != nullptr) {
+      size_t size = archiveBlockSize(header->signals);
+      if (block != nullptr) {
+        munmap(block, size);
+        block = nullptr;
+      }
+      // хвост последнего блока не обрезается: столбцы блока имеют
+      // фиксированное смещение
+      header->closed = 1;
+      msync(header, archiveDataOffset(), MS_SYNC);
+      munmap(header, archiveDataOffset());
+      header = nullptr;
+    }
+    if (fd >= 0) {
+      ::close(fd);
+      fd = -1;
+    }
+  }
+};
+
+class ArchiveReader {
+private:
+  const uint8_t *map = nullptr;
+  size_t size = 0;
+  const ArchiveHeader *header = nullptr;
+
+  const uint8_t *blockAt(uint32_t b) const {
+    return map + archiveDataOffset() + b * archiveBlockSize(header->signals);
+  }
+
+public:
+  ~ArchiveReader() { close(); }
+
+  bool open(const char *path) {
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        static_cast<size_t>(st.st_size) < archiveDataOffset()) {
+      ::close(fd);
+      return false;
+    }
+    void *m = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (m == MAP_FAILED) {
+      return false;
+    }
+    map = static_cast<const uint8_t *>(m);
+    size = st.st_size;
+    header = reinterpret_cast<const ArchiveHeader *>(map);
+    if (memcmp(header->magic, ARCHIVE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != ARCHIVE_VERSION ||
+        header->block_rows != ARCHIVE_BLOCK_ROWS) {
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  void close() {
+    if (map != nullptr) {
+      munmap(const_cast<uint8_t *>(map), size);
+      map = nullptr;
+      header = nullptr;
+    }
+  }
+
+  const ArchiveHeader &getHeader() const { return *header; }
+
+  // Пишущий процесс мог уже учесть строку, блок которой ещё не отображён
+  uint32_t rows() const {
+    uint64_t blocks = (size - archiveDataOffset()) /
+                      archiveBlockSize(header->signals);
+    uint64_t r = blocks * header->block_rows;
+    uint32_t written = __atomic_load_n(&header->rows, __ATOMIC_ACQUIRE);
+    return written < r ? written : static_cast<uint32_t>(r);
+  }
+
+  uint32_t signals() const { return header->signals; }
+
+  uint32_t time(uint32_t row) const {
+    const uint32_t *t = reinterpret_cast<const uint32_t *>(
+        blockAt(row / header->block_rows));
+    return t[row % header->block_rows];
+  }
+
+  int32_t value(uint32_t signal, uint32_t row) const {
+    const int32_t *v = reinterpret_cast<const int32_t *>(
+        blockAt(row / header->block_rows));
+    return v[(signal + 1) * header->block_rows + row % header->block_rows];
+  }
+
+  // Первая строка со временем >= time: бинарный поиск по индексу блоков,
+  // затем внутри блока
+  uint32_t lowerBound(uint32_t time) const {
+    uint32_t n = rows();
+    uint32_t blocks = (n + header->block_rows - 1) / header->block_rows;
+    uint32_t lo = 0;
+    uint32_t hi = blocks;
+    while (lo < hi) {
+      uint32_t mid = (lo + hi) / 2;
+      if (header->index[mid].last < time) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    uint32_t row = lo * header->block_rows;
+    if (row >= n) {
+      return n;
+    }
+    uint32_t end = row + header->block_rows < n ? row + header->block_rows : n;
+    const uint32_t *t = reinterpret_cast<const uint32_t *>(blockAt(lo));
+    return row + (std::lower_bound(t, t + (end - row), time) - t);
+  }
+};
+
+#endif
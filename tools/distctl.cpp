@@ -0,0 +1,228 @@
+// Управление контроллером с компьютера: чтение и запись регистров,
+// выгрузка и загрузка образа настроек, просмотр телеметрии.
+//
+// Сборка из корня проекта:
+//   g++ -std=c++11 -O2 -Ilib/PacketLib -Ilib/TelemetryLib tools/distctl.cpp
+//       lib/PacketLib/Packet.cpp lib/TelemetryLib/Telemetry.cpp -o distctl
+
+#include "names.h"
+#include "port.h"
+#include <Protocol.h>
+#include <Telemetry.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TIMEOUT 500
+
+static int usage() {
+  fprintf(stderr, "usage: distctl PORT [-b BAUD] [-a ADDRESS] COMMAND\n"
+                  "  list | get REG | set REG VALUE\n"
+                  "  dump FILE | push FILE | save | watch\n"
+                  "  events [saved]\n");
+  return 2;
+}
+
+static int findRegister(const char *name) {
+  for (int r = PACKET_REGISTER; r < REG_END; r++) {
+    if (strcmp(REGISTER_NAMES[r - PACKET_REGISTER], name) == 0) {
+      return r;
+    }
+  }
+  char *e;
+  long r = strtol(name, &e, 0);
+  if (*e == 0 && r >= PACKET_REGISTER && r < REG_END) {
+    return static_cast<int>(r);
+  }
+  return -1;
+}
+
+static bool check(Packet *r) {
+  if (r != nullptr && r->getAddress() == ADDRESS_BROADCAST) {
+    return true;
+  }
+  if (r == nullptr) {
+    fprintf(stderr, "timeout\n");
+    return false;
+  }
+  if (r->getId() == PACKET_NACK) {
+    const uint8_t *b = r->getPayload();
+    fprintf(stderr, "nack: id 0x%02x code %u\n", b[0], b[1]);
+    return false;
+  }
+  return true;
+}
+
+static int get(Port &port, uint8_t reg) {
+  Packet p;
+  p.init(reg, nullptr, 0);
+  Packet *r = port.request(p, reg, TIMEOUT);
+  if (!check(r)) {
+    return 1;
+  }
+  printf("%s %u\n", REGISTER_NAMES[reg - PACKET_REGISTER], r->getVal());
+  return 0;
+}
+
+static int set(Port &port, uint8_t reg, uint16_t val) {
+  Packet p;
+  p.init(reg, val);
+  Packet *r = port.request(p, reg, TIMEOUT);
+  if (!check(r)) {
+    return 1;
+  }
+  printf("%s %u\n", REGISTER_NAMES[reg - PACKET_REGISTER], r->getVal());
+  return 0;
+}
+
+static int dump(Port &port, const char *file) {
+  Packet p;
+  p.init(PACKET_BLOCK_READ, nullptr, 0);
+  Packet *r = port.request(p, PACKET_BLOCK_READ, TIMEOUT);
+  if (!check(r)) {
+    return 1;
+  }
+  FILE *f = fopen(file, "wb");
+  if (f == nullptr || fwrite(r->getPayload(), 1, r->getLength(), f) !=
+                          r->getLength()) {
+    perror(file);
+    return 1;
+  }
+  fclose(f);
+  return 0;
+}
+
+static int push(Port &port, const char *file) {
+  uint8_t b[PACKET_PAYLOAD_SIZE];
+  FILE *f = fopen(file, "rb");
+  if (f == nullptr) {
+    perror(file);
+    return 1;
+  }
+  size_t n = fread(b, 1, sizeof(b), f);
+  fclose(f);
+  Packet p;
+  p.init(PACKET_BLOCK_WRITE, b, static_cast<uint8_t>(n));
+  uint64_t start = nowMicros();
+  Packet *r = port.request(p, PACKET_BLOCK_WRITE, TIMEOUT);
+  if (!check(r)) {
+    return 1;
+  }
+  printf("pushed %zu bytes in %.1f ms\n", n, (nowMicros() - start) / 1000.0);
+  return 0;
+}
+
+static int save(Port &port) {
+  Packet p;
+  p.init(PACKET_SAVE, nullptr, 0);
+  return check(port.request(p, PACKET_SAVE, TIMEOUT)) ? 0 : 1;
+}
+
+// Время событий в тиках контроллера по 1024 мс, выводится как "назад" от
+// момента ответа
+static int events(Port &port, bool saved) {
+  Packet p;
+  uint8_t b = saved ? 1 : 0;
+  p.init(PACKET_EVENTS, &b, 1);
+  Packet *r = port.request(p, PACKET_EVENTS, TIMEOUT);
+  if (!check(r)) {
+    return 1;
+  }
+  const uint8_t *e = r->getPayload();
+  uint32_t now = e[0] | e[1] << 8 | static_cast<uint32_t>(e[2]) << 16;
+  for (uint8_t i = EVENT_TIME_SIZE; i + EVENT_SIZE <= r->getLength();
+       i += EVENT_SIZE) {
+    uint32_t time = e[i] | e[i + 1] << 8 | static_cast<uint32_t>(e[i + 2]) << 16;
+    uint8_t code = e[i + 3];
+    printf("-%7.0fs %-10s %3u %3u\n", ((now - time) & 0xFFFFFF) * 1.024,
+           code < EVENT_COUNT ? EVENT_NAMES[code] : "?", e[i + 4], e[i + 5]);
+  }
+  return 0;
+}
+
+static int watch(Port &port) {
+  Telemetry t;
+  for (;;) {
+    Packet *r = port.receive(-1);
+    if (r == nullptr) {
+      return 1;
+    }
+    if (r->getId() != PACKET_TELEMETRY ||
+        !t.decode(r->getPayload(), r->getLength())) {
+      continue;
+    }
+    for (uint8_t x = 0; x < TELEMETRY_FIELDS; x++) {
+      printf("%s=%ld ", TELEMETRY_NAMES[x], static_cast<long>(t.get(x)));
+    }
+    printf("\n");
+    fflush(stdout);
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    return usage();
+  }
+  int a = 2;
+  unsigned long baud = 9600;
+  long address = ADDRESS_NONE;
+  while (argc > a + 2 && argv[a][0] == '-') {
+    if (strcmp(argv[a], "-b") == 0) {
+      baud = strtoul(argv[a + 1], nullptr, 10);
+    } else if (strcmp(argv[a], "-a") == 0) {
+      address = strtol(argv[a + 1], nullptr, 0);
+    } else {
+      return usage();
+    }
+    a += 2;
+  }
+  if (address < ADDRESS_NONE || address > ADDRESS_BROADCAST) {
+    return usage();
+  }
+  Port port;
+  if (!port.open(argv[1], baud)) {
+    perror(argv[1]);
+    return 1;
+  }
+  port.setAddress(static_cast<uint8_t>(address));
+  const char *cmd = argv[a++];
+  int rest = argc - a;
+  if (address == ADDRESS_BROADCAST && strcmp(cmd, "set") != 0 &&
+      strcmp(cmd, "push") != 0 && strcmp(cmd, "save") != 0) {
+    fprintf(stderr, "broadcast supports set, push and save only\n");
+    return 2;
+  }
+  if (strcmp(cmd, "list") == 0) {
+    for (int r = PACKET_REGISTER; r < REG_END; r++) {
+      get(port, r);
+    }
+    return 0;
+  }
+  if ((strcmp(cmd, "get") == 0 && rest == 1) ||
+      (strcmp(cmd, "set") == 0 && rest == 2)) {
+    int reg = findRegister(argv[a]);
+    if (reg < 0) {
+      fprintf(stderr, "unknown register %s\n", argv[a]);
+      return 2;
+    }
+    if (rest == 1) {
+      return get(port, reg);
+    }
+    return set(port, reg, strtoul(argv[a + 1], nullptr, 0));
+  }
+  if (strcmp(cmd, "dump") == 0 && rest == 1) {
+    return dump(port, argv[a]);
+  }
+  if (strcmp(cmd, "push") == 0 && rest == 1) {
+    return push(port, argv[a]);
+  }
+  if (strcmp(cmd, "save") == 0) {
+    return save(port);
+  }
+  if (strcmp(cmd, "watch") == 0) {
+    return watch(port);
+  }
+  if (strcmp(cmd, "events") == 0 && rest <= 1) {
+    return events(port, rest == 1 && strcmp(argv[a], "saved") == 0);
+  }
+  return usage();
+}
@@ -0,0 +1,147 @@
+// Проверка Fixed<F> на компьютере: арифметика и ratio против float,
+// насыщение, границы 32-битных путей, и расчёт скорости и литров насоса из
+// src/main.cpp.
+//
+// Сборка и запуск из корня проекта:
+//   g++ -std=c++11 -O2 -Ilib/FixedLib tools/fixedtest.cpp -o fixedtest
+//   ./fixedtest
+//
+// Код возврата - число ошибок
+
+#include <Fixed.h>
+#include <math.h>
+#include <stdio.h>
+
+typedef Fixed<8> Q8;
+typedef Fixed<16> Q16;
+
+#define PUMP_CONTROL_SECOND 10 //как в src/main.cpp
+
+static int failures = 0;
+
+static void check(bool ok, const char *what, double got, double want) {
+  if (!ok) {
+    printf("FAIL %s: %f, ожидалось %f\n", what, got, want);
+    failures++;
+  }
+}
+
+// want за пределами Q(31-F).F ожидается насыщенным
+template <uint8_t F>
+static void near(const char *what, Fixed<F> got, double want,
+                 double ulps = 1) {
+  double g = static_cast<double>(got.getRaw()) / (1L << F);
+  want = fmin(fmax(want, static_cast<double>(FIXED_MIN) / (1L << F)),
+              static_cast<double>(FIXED_MAX) / (1L << F));
+  check(fabs(g - want) <= ulps / (1L << F) + fabs(want) * 1e-6, what, g,
+        want);
+}
+
+template <uint8_t F> static void arithmetic() {
+  typedef Fixed<F> Q;
+  const float values[] = {0, 0.1F, -0.1F, 0.35F, 1, -1, 2.5F, -7.75F,
+                          12.34F, -56.78F, 100, -250.5F};
+  for (float a : values) {
+    Q qa = Q::fromFloat(a);
+    near("fromFloat", qa, a, 0.5);
+    for (float b : values) {
+      Q qb = Q::fromFloat(b);
+      double fa = qa.toFloat();
+      double fb = qb.toFloat();
+      near("+", qa + qb, fa + fb);
+      near("-", qa - qb, fa - fb);
+      near("*", qa * qb, fa * fb);
+      if (qb.getRaw() != 0) {
+        near("/", qa / qb, fa / fb);
+      }
+      check((qa < qb) == (fa < fb), "<", fa, fb);
+    }
+    near("*int", qa * 7, qa.toFloat() * 7.0);
+    near("/int", qa / 3, qa.toFloat() / 3.0);
+    check(qa.toInt() == static_cast<int32_t>(qa.toFloat()), "toInt",
+          qa.toInt(), qa.toFloat());
+    check(qa.round() == lround(qa.toFloat()), "round", qa.round(),
+          qa.toFloat());
+  }
+  for (int32_t n = -1000; n <= 1000; n += 37) {
+    for (int32_t d = 1; d <= 1000; d += 53) {
+      near("ratio", Q::ratio(n, d), static_cast<double>(n) / d);
+    }
+  }
+}
+
+template <uint8_t F> static void saturation() {
+  typedef Fixed<F> Q;
+  Q max = Q::raw(FIXED_MAX);
+  Q min = Q::raw(FIXED_MIN);
+  Q one = Q::fromInt(1);
+  check((max + one).getRaw() == FIXED_MAX, "max + 1", (max + one).getRaw(),
+        FIXED_MAX);
+  check((min - one).getRaw() == FIXED_MIN, "min - 1", (min - one).getRaw(),
+        FIXED_MIN);
+  check((-min).getRaw() == FIXED_MAX, "-min", (-min).getRaw(), FIXED_MAX);
+  check((max * Q::fromInt(2)).getRaw() == FIXED_MAX, "max * 2",
+        (max * Q::fromInt(2)).getRaw(), FIXED_MAX);
+  check((min * 2).getRaw() == FIXED_MIN, "min * 2", (min * 2).getRaw(),
+        FIXED_MIN);
+  check((one / Q()).getRaw() == FIXED_MAX, "1 / 0", (one / Q()).getRaw(),
+        FIXED_MAX);
+  check((-one / 0).getRaw() == FIXED_MIN, "-1 / 0", (-one / 0).getRaw(),
+        FIXED_MIN);
+  check(Q::fromInt(1L << (31 - F)).getRaw() == FIXED_MAX, "fromInt",
+        Q::fromInt(1L << (31 - F)).getRaw(), FIXED_MAX);
+  check(Q::fromFloat(1e12F).getRaw() == FIXED_MAX, "fromFloat",
+        Q::fromFloat(1e12F).getRaw(), FIXED_MAX);
+}
+
+// операнды на границах 32-битного пути умножения и деления
+template <uint8_t F> static void boundaries() {
+  typedef Fixed<F> Q;
+  const int32_t edges[] = {1L << 15, 1L << 16, 1L << (31 - F), 1L << 23};
+  for (int32_t e : edges) {
+    const int32_t around[] = {e - 1, e, -e + 1, -e, 3, -77};
+    for (int32_t a : around) {
+      for (int32_t b : around) {
+        Q qa = Q::raw(a);
+        Q qb = Q::raw(b);
+        double fa = qa.toFloat();
+        double fb = qb.toFloat();
+        near("* на границе", qa * qb, fa * fb);
+        near("/ на границе", qa / qb, fa / fb);
+        near("*int на границе", qa * b, fa * b);
+        near("ratio на границе", Q::ratio(a, b), static_cast<double>(a) / b);
+      }
+    }
+  }
+}
+
+// Pump::speed и Pump::getLiters: s - импульсов за PUMP_CONTROL_SECOND с,
+// coeff - data.pump_coeff
+static void pump() {
+  for (int16_t coeff = 10; coeff <= 1000; coeff += 7) {
+    for (uint32_t s = 1; s < 20000; s = s * 3 + 1) {
+      double want = s / static_cast<double>(PUMP_CONTROL_SECOND) /
+                    coeff * 100 * 3.6;
+      near("Pump::speed", Q8::ratio(s * 360, PUMP_CONTROL_SECOND * coeff),
+           want);
+    }
+    for (uint32_t all = 0; all < 10000000; all = all * 5 + 3) {
+      float got = Q8::ratio(all, coeff).round() / 10.0F;
+      double want = round(static_cast<double>(all) / coeff) / 10;
+      check(fabs(got - want) <= 0.1 + want * 1e-6, "Pump::getLiters", got,
+            want);
+    }
+  }
+}
+
+int main() {
+  arithmetic<8>();
+  arithmetic<16>();
+  saturation<8>();
+  saturation<16>();
+  boundaries<8>();
+  boundaries<16>();
+  pump();
+  printf("%s, ошибок: %d\n", failures == 0 ? "OK" : "FAIL", failures);
+  return failures;
+}
@@ -0,0 +1,50 @@
+#ifndef names_h
+#define names_h
+
+// Имена регистров и полей телеметрии для утилит хоста
+
+#include <Protocol.h>
+#include <Telemetry.h>
+
+static const char *REGISTER_NAMES[] = {
+    "pump_speed",      "pump_coeff",      "tsa",
+    "nbk_bard",        "nbk_output",      "nbk_delta",
+    "nbk_watt",        "nbk_to_myself",   "rect_cube_tail",
+    "rect_cube_end",   "rect_output",     "rect_delta",
+    "rect_delta_tail", "rect_watt",       "rect_speed_head",
+    "rect_speed_body", "rect_speed_reduction",
+    "rect_to_myself",  "rect_trim_kp",    "rect_trim_kd",
+    "rect_settle",     "node_address",    "teng_one_watt",
+    "teng_two_watt",   "heater_window",   "nbk_pump_min",
+    "nbk_pump_max",    "nbk_kp",          "nbk_ki",
+    "nbk_feed_ff",     "nbk_feed_rate",   "nbk_maximize",
+    "nbk_backoff",     "nbk_probe_step",  "nbk_sag",
+    "stab_band",       "stab_slope",      "stab_window",
+    "stab_min",        "nbk_mash",        "rect_abv_tail",
+    "rect_abv_end",    "pressure",
+    "status",          "mode",            "real_speed_body",
+    "pump_manual",     "pump_pwm",        "feed_max",
+    "body_trim",       "overclock_time",  "overclock_lead",
+    "interlock_reaction", "loop_max",  "energy",
+    "energy_per_liter", "product",  "eta",
+    "cube_abv",        "output_abv"};
+static_assert(sizeof(REGISTER_NAMES) / sizeof(REGISTER_NAMES[0]) ==
+                  REG_END - PACKET_REGISTER,
+              "REGISTER_NAMES must match Register");
+
+static const char *TELEMETRY_NAMES[] = {
+    "bard",   "output", "tsa",  "pump_speed", "real_speed", "pwm",
+    "liters", "status", "mode", "valve",      "body_speed", "power",
+    "energy", "product", "eta"};
+static_assert(sizeof(TELEMETRY_NAMES) / sizeof(TELEMETRY_NAMES[0]) ==
+                  TELEMETRY_FIELDS,
+              "TELEMETRY_NAMES must match TelemetryField");
+
+static const char *EVENT_NAMES[] = {
+    "boot",   "status", "mode", "rule", "interlock", "sensor",
+    "pause",  "resume", "trim", "feed", "feed_max",  "save",
+    "migrate", "watchdog"};
+static_assert(sizeof(EVENT_NAMES) / sizeof(EVENT_NAMES[0]) == EVENT_COUNT,
+              "EVENT_NAMES must match EventCode");
+
+#endif
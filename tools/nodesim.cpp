@@ -0,0 +1,135 @@
+// Имитация нескольких контроллеров на общей шине для проверки без железа.
+// Создаёт псевдотерминал, печатает его путь и отвечает за узлы ADDRESS...
+// с задержкой DELAY_US. Узлы из -s молчат, чтобы проверить таймауты.
+//
+// Сборка из корня проекта:
+//   g++ -std=c++11 -O2 -Ilib/PacketLib -Ilib/TelemetryLib tools/nodesim.cpp
+//       lib/PacketLib/Packet.cpp lib/TelemetryLib/Telemetry.cpp -o nodesim
+//
+// nodesim [-d DELAY_US] [-s SILENT_ADDRESS] ADDRESS...
+//
+// Пример: nodesim -s 3 1 2 3 > pty & poller $(cat pty) 1 2 3
+
+#include "port.h"
+#include <Protocol.h>
+#include <Telemetry.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+struct SimNode {
+  uint8_t address;
+  bool silent = false;
+  Telemetry telemetry;
+  int32_t values[TELEMETRY_FIELDS];
+  uint16_t registers[REG_END - PACKET_REGISTER];
+};
+
+static void step(SimNode &n) {
+  n.values[TM_BARD_TEMP] += rand() % 3 - 1;
+  n.values[TM_OUTPUT_TEMP] += rand() % 3 - 1;
+  n.values[TM_REAL_PUMP_SPEED] =
+      n.values[TM_PUMP_SPEED] + rand() % 21 - 10;
+  n.values[TM_LITERS] += rand() % 4 == 0;
+}
+
+static void reply(Port &port, SimNode &n, Packet &in) {
+  Packet out;
+  uint8_t id = in.getId();
+  if (id == PACKET_TELEMETRY) {
+    if (in.getLength() > 0 && (in.getPayload()[0] & TELEMETRY_KEY)) {
+      n.telemetry.reset();
+    }
+    step(n);
+    uint8_t b[PACKET_PAYLOAD_SIZE];
+    out.init(id, b, n.telemetry.encode(n.values, b, sizeof(b)));
+  } else if (id >= PACKET_REGISTER && id < REG_END) {
+    if (in.getLength() == sizeof(uint16_t)) {
+      n.registers[id - PACKET_REGISTER] = in.getVal();
+      if (id == REG_STATUS) {
+        n.values[TM_STATUS] = in.getVal();
+      }
+    }
+    out.init(id, n.registers[id - PACKET_REGISTER]);
+  } else if (id == PACKET_BLOCK_READ) {
+    out.init(id, reinterpret_cast<const uint8_t *>(n.registers),
+             sizeof(n.registers));
+  } else {
+    uint8_t b[] = {id, NACK_UNKNOWN};
+    out.init(PACKET_NACK, b, sizeof(b));
+  }
+  if (in.getAddress() == ADDRESS_BROADCAST) {
+    return;
+  }
+  port.setAddress(n.address | ADDRESS_REPLY);
+  port.send(out);
+}
+
+int main(int argc, char **argv) {
+  long delay = 2000;
+  std::vector<SimNode> nodes;
+  std::vector<long> silent;
+  for (int a = 1; a < argc; a++) {
+    if (strcmp(argv[a], "-d") == 0 && a + 1 < argc) {
+      delay = strtol(argv[++a], nullptr, 0);
+    } else if (strcmp(argv[a], "-s") == 0 && a + 1 < argc) {
+      silent.push_back(strtol(argv[++a], nullptr, 0));
+    } else {
+      nodes.push_back(SimNode());
+      SimNode &n = nodes.back();
+      n.address = static_cast<uint8_t>(strtol(argv[a], nullptr, 0));
+      memset(n.values, 0, sizeof(n.values));
+      memset(n.registers, 0, sizeof(n.registers));
+      n.values[TM_BARD_TEMP] = 985;
+      n.values[TM_OUTPUT_TEMP] = 902;
+      n.values[TM_TSA_TEMP] = 250;
+      n.values[TM_PUMP_SPEED] = 1550;
+      n.values[TM_STATUS] = PROCESS;
+      n.values[TM_POWER] = 1500;
+      n.registers[REG_STATUS - PACKET_REGISTER] = PROCESS;
+      n.registers[REG_NODE_ADDRESS - PACKET_REGISTER] = n.address;
+    }
+  }
+  if (nodes.empty()) {
+    fprintf(stderr, "usage: nodesim [-d DELAY_US] [-s SILENT_ADDRESS] "
+                    "ADDRESS...\n");
+    return 2;
+  }
+  for (SimNode &n : nodes) {
+    for (long s : silent) {
+      n.silent = n.silent || s == n.address;
+    }
+  }
+  int fd = posix_openpt(O_RDWR | O_NOCTTY);
+  if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0) {
+    perror("posix_openpt");
+    return 1;
+  }
+  struct termios t;
+  tcgetattr(fd, &t);
+  cfmakeraw(&t);
+  tcsetattr(fd, TCSANOW, &t);
+  printf("%s\n", ptsname(fd));
+  fflush(stdout);
+  Port port;
+  port.attach(fd);
+  for (;;) {
+    Packet *in = port.receive(-1);
+    if (in == nullptr) {
+      // ведущий ещё не открыл pty или закрыл его
+      usleep(10000);
+      continue;
+    }
+    uint8_t a = in->getAddress();
+    if (a & ADDRESS_REPLY) {
+      continue;
+    }
+    for (SimNode &n : nodes) {
+      if (n.silent || (a != n.address && a != ADDRESS_BROADCAST)) {
+        continue;
+      }
+      usleep(delay);
+      reply(port, n, *in);
+    }
+  }
+}
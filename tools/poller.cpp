@@ -0,0 +1,161 @@
+// Ведущий шины: по кругу опрашивает узлы телеметрией, ждёт ответ не дольше
+// таймаута и считает задержку ответа каждого узла.
+//
+// Сборка из корня проекта:
+//   g++ -std=c++11 -O2 -Ilib/PacketLib -Ilib/TelemetryLib tools/poller.cpp
+//       lib/PacketLib/Packet.cpp lib/TelemetryLib/Telemetry.cpp -o poller
+//
+// poller PORT [-b BAUD] [-t TIMEOUT_MS] [-i INTERVAL_MS] [-c CYCLES] ADDRESS...
+
+#include "port.h"
+#include <Protocol.h>
+#include <Telemetry.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+struct Node {
+  uint8_t address;
+  Telemetry telemetry;
+  bool key = true;
+  unsigned long polls = 0;
+  unsigned long replies = 0;
+  unsigned long timeouts = 0;
+  unsigned long errors = 0;
+  uint64_t latency_sum = 0;
+  uint64_t latency_min = UINT64_MAX;
+  uint64_t latency_max = 0;
+};
+
+static volatile sig_atomic_t stop = 0;
+
+static void onSignal(int) { stop = 1; }
+
+static int usage() {
+  fprintf(stderr, "usage: poller PORT [-b BAUD] [-t TIMEOUT_MS] "
+                  "[-i INTERVAL_MS] [-c CYCLES] ADDRESS...\n");
+  return 2;
+}
+
+static void poll(Port &port, Node &n, int timeout) {
+  Packet p;
+  uint8_t key = TELEMETRY_KEY;
+  p.init(PACKET_TELEMETRY, &key, n.key ? 1 : 0);
+  port.setAddress(n.address);
+  n.polls++;
+  uint64_t start = nowMicros();
+  Packet *r = port.request(p, PACKET_TELEMETRY, timeout);
+  // потерянный или отброшенный по CRC кадр сбивает дельты узла, поэтому
+  // после любой ошибки следующий опрос просит ключевой кадр
+  if (r == nullptr) {
+    n.timeouts++;
+    n.key = true;
+    return;
+  }
+  uint64_t l = nowMicros() - start;
+  n.replies++;
+  n.latency_sum += l;
+  n.latency_min = l < n.latency_min ? l : n.latency_min;
+  n.latency_max = l > n.latency_max ? l : n.latency_max;
+  if (r->getId() != PACKET_TELEMETRY ||
+      !n.telemetry.decode(r->getPayload(), r->getLength())) {
+    n.errors++;
+    n.key = true;
+    return;
+  }
+  n.key = false;
+}
+
+static void print(Node &n) {
+  printf("node %3u bard %5.1f output %5.1f tsa %5.1f pump %6.2f status %ld\n",
+         n.address, n.telemetry.get(TM_BARD_TEMP) / 10.0,
+         n.telemetry.get(TM_OUTPUT_TEMP) / 10.0,
+         n.telemetry.get(TM_TSA_TEMP) / 10.0,
+         n.telemetry.get(TM_PUMP_SPEED) / 100.0,
+         static_cast<long>(n.telemetry.get(TM_STATUS)));
+}
+
+static void report(std::vector<Node> &nodes) {
+  printf("node    polls  replies timeouts   errors  min ms  avg ms  max ms\n");
+  for (Node &n : nodes) {
+    double avg = n.replies ? n.latency_sum / 1000.0 / n.replies : 0;
+    double min = n.replies ? n.latency_min / 1000.0 : 0;
+    printf("%4u %8lu %8lu %8lu %8lu %7.2f %7.2f %7.2f\n", n.address, n.polls,
+           n.replies, n.timeouts, n.errors, min, avg,
+           n.latency_max / 1000.0);
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    return usage();
+  }
+  unsigned long baud = 9600;
+  int timeout = 100;
+  int interval = 1000;
+  long cycles = -1;
+  std::vector<Node> nodes;
+  for (int a = 2; a < argc; a++) {
+    if (argv[a][0] == '-' && a + 1 < argc) {
+      long v = strtol(argv[a + 1], nullptr, 0);
+      switch (argv[a][1]) {
+      case 'b':
+        baud = v;
+        break;
+      case 't':
+        timeout = v;
+        break;
+      case 'i':
+        interval = v;
+        break;
+      case 'c':
+        cycles = v;
+        break;
+      default:
+        return usage();
+      }
+      a++;
+      continue;
+    }
+    long v = strtol(argv[a], nullptr, 0);
+    if (v <= ADDRESS_NONE || v >= ADDRESS_BROADCAST) {
+      return usage();
+    }
+    nodes.push_back(Node());
+    nodes.back().address = static_cast<uint8_t>(v);
+  }
+  if (nodes.empty()) {
+    return usage();
+  }
+  Port port;
+  if (!port.open(argv[1], baud)) {
+    perror(argv[1]);
+    return 1;
+  }
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  // Цикл опроса начинается раз в interval, узлы опрашиваются подряд
+  uint64_t next = nowMicros();
+  for (long c = 0; !stop && (cycles < 0 || c < cycles); c++) {
+    for (Node &n : nodes) {
+      poll(port, n, timeout);
+      if (stop) {
+        break;
+      }
+    }
+    for (Node &n : nodes) {
+      print(n);
+    }
+    fflush(stdout);
+    next += static_cast<uint64_t>(interval) * 1000;
+    uint64_t now = nowMicros();
+    if (next > now) {
+      usleep(next - now);
+    } else {
+      next = now;
+    }
+  }
+  report(nodes);
+  return 0;
+}
@@ -0,0 +1,156 @@
+#ifndef port_h
+#define port_h
+
+// Общий для утилит хоста обмен пакетами через последовательный порт или pty
+
+#include <Packet.h>
+#include <Protocol.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+#include <termios.h>
+#include <unistd.h>
+
+inline uint64_t nowMicros() {
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  return static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+inline speed_t toSpeed(unsigned long baud) {
+  switch (baud) {
+  case 9600:
+    return B9600;
+  case 19200:
+    return B19200;
+  case 38400:
+    return B38400;
+  case 57600:
+    return B57600;
+  case 115200:
+    return B115200;
+  default:
+    return B9600;
+  }
+}
+
+class Port {
+private:
+  int fd = -1;
+  uint8_t address = ADDRESS_NONE;
+  Packet in;
+
+public:
+  ~Port() { close(); }
+
+  bool open(const char *path, unsigned long baud = 9600) {
+    fd = ::open(path, O_RDWR | O_NOCTTY);
+    if (fd < 0) {
+      return false;
+    }
+    struct termios t;
+    if (tcgetattr(fd, &t) == 0) {
+      cfmakeraw(&t);
+      cfsetispeed(&t, toSpeed(baud));
+      cfsetospeed(&t, toSpeed(baud));
+      t.c_cflag |= CLOCAL | CREAD;
+      tcsetattr(fd, TCSANOW, &t);
+    }
+    return true;
+  }
+
+  void attach(int f) { fd = f; }
+
+  void close() {
+    if (fd >= 0) {
+      ::close(fd);
+      fd = -1;
+    }
+  }
+
+  int getFd() { return fd; }
+
+  void setAddress(uint8_t a) { address = a; }
+  uint8_t getAddress() { return address; }
+
+  bool send(Packet &p) {
+    p.setAddress(address);
+    p.fill();
+    const uint8_t *b = p.getFrame();
+    size_t n = p.getFrameLength();
+    while (n > 0) {
+      ssize_t w = ::write(fd, b, n);
+      if (w < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return false;
+      }
+      b += w;
+      n -= w;
+    }
+    return true;
+  }
+
+  // Ждёт следующий целый кадр не дольше timeout мс, -1 - без ограничения
+  Packet *receive(int timeout) {
+    uint64_t end = nowMicros() + static_cast<uint64_t>(timeout) * 1000;
+    uint8_t b;
+    if (in.next()) {
+      return &in;
+    }
+    for (;;) {
+      int wait = -1;
+      if (timeout >= 0) {
+        uint64_t now = nowMicros();
+        wait = now >= end ? 0 : static_cast<int>((end - now + 999) / 1000);
+      }
+      struct pollfd p = {fd, POLLIN, 0};
+      int r = poll(&p, 1, wait);
+      if (r < 0 && errno == EINTR) {
+        continue;
+      }
+      if (r <= 0) {
+        return nullptr;
+      }
+      if (::read(fd, &b, 1) != 1) {
+        return nullptr;
+      }
+      if (in.write(b)) {
+        return &in;
+      }
+    }
+  }
+
+  // Отправляет запрос и ждёт ответ узла с ожидаемым ID (или NACK)
+  Packet *request(Packet &p, uint8_t reply, int timeout) {
+    if (!send(p)) {
+      return nullptr;
+    }
+    if (address == ADDRESS_BROADCAST) {
+      return &p;
+    }
+    uint64_t end = nowMicros() + static_cast<uint64_t>(timeout) * 1000;
+    for (;;) {
+      uint64_t now = nowMicros();
+      if (now >= end) {
+        return nullptr;
+      }
+      Packet *r = receive(static_cast<int>((end - now) / 1000));
+      if (r == nullptr) {
+        return nullptr;
+      }
+      if (r->getAddress() != (address | ADDRESS_REPLY)) {
+        continue;
+      }
+      if (r->getId() == reply || r->getId() == PACKET_NACK) {
+        return r;
+      }
+    }
+  }
+};
+
+#endif
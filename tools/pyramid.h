@@ -0,0 +1,339 @@
+#ifndef pyramid_h
+#define pyramid_h
+
+// Прореженные уровни архива запуска для быстрого построения графиков.
+// Для уровня с шагом PYRAMID_FACTORS[l] рядом с архивом RUN лежит файл
+// RUN.lN: PyramidHeader и записи PyramidBucket - интервал времени, число
+// исходных строк и min/max/среднее каждого сигнала за N исходных строк.
+// Уровень l строится из уровня l-1, поэтому записи дописываются по мере
+// записи архива. Средние сводятся с весом по числу строк. Число готовых
+// записей писатель публикует в заголовке после того, как записи сброшены в
+// файл, поэтому читатель не видит записанную наполовину.
+
+#include "archive.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#define PYRAMID_MAGIC "PYR3"
+#define PYRAMID_LEVELS 3
+static const uint32_t PYRAMID_FACTORS[PYRAMID_LEVELS] = {10, 100, 1000};
+
+struct PyramidValue {
+  int32_t min;
+  int32_t max;
+  int32_t mean;
+};
+
+struct PyramidHeader {
+  char magic[4];
+  uint32_t signals;
+  uint32_t count; //опубликованных записей
+};
+
+struct PyramidBucket {
+  uint32_t first;
+  uint32_t last;
+  uint32_t rows; //исходных строк в записи
+  PyramidValue values[TELEMETRY_FIELDS];
+};
+
+inline std::string pyramidPath(const char *run, uint8_t level) {
+  return std::string(run) + ".l" + std::to_string(PYRAMID_FACTORS[level]);
+}
+
+class PyramidWriter {
+private:
+  struct Level {
+    FILE *file = nullptr;
+    PyramidBucket bucket;
+    int64_t sum[TELEMETRY_FIELDS];
+    uint32_t rows = 0;  //исходных строк в текущей ячейке
+    uint32_t count = 0; //записей нижнего уровня в текущей ячейке
+    uint32_t written = 0;
+  };
+  Level levels[PYRAMID_LEVELS];
+  uint32_t signals = TELEMETRY_FIELDS;
+
+  void add(uint8_t l, const PyramidBucket &b) {
+    uint32_t rows = b.rows;
+    Level &v = levels[l];
+    if (v.count == 0) {
+      v.bucket = b;
+      for (uint32_t s = 0; s < signals; s++) {
+        v.sum[s] = static_cast<int64_t>(b.values[s].mean) * rows;
+      }
+    } else {
+      v.bucket.last = b.last;
+      for (uint32_t s = 0; s < signals; s++) {
+        PyramidValue &p = v.bucket.values[s];
+        p.min = b.values[s].min < p.min ? b.values[s].min : p.min;
+        p.max = b.values[s].max > p.max ? b.values[s].max : p.max;
+        v.sum[s] += static_cast<int64_t>(b.values[s].mean) * rows;
+      }
+    }
+    v.rows += rows;
+    v.count++;
+    if (v.count == (l == 0 ? PYRAMID_FACTORS[0]
+                           : PYRAMID_FACTORS[l] / PYRAMID_FACTORS[l - 1])) {
+      emit(l);
+    }
+  }
+
+  // счётчик пишется отдельно от буфера FILE и только после сброса записей
+  void publish(uint8_t l) {
+    Level &v = levels[l];
+    if (v.file == nullptr) {
+      return;
+    }
+    fflush(v.file);
+    if (pwrite(fileno(v.file), &v.written, sizeof(v.written),
+               offsetof(PyramidHeader, count)) != sizeof(v.written)) {
+      perror("pyramid");
+    }
+  }
+
+  void emit(uint8_t l) {
+    Level &v = levels[l];
+    if (v.count == 0) {
+      return;
+    }
+    for (uint32_t s = 0; s < signals; s++) {
+      v.bucket.values[s].mean = static_cast<int32_t>(v.sum[s] / v.rows);
+    }
+    v.bucket.rows = v.rows;
+    if (v.file != nullptr) {
+      fwrite(&v.bucket, sizeof(PyramidBucket), 1, v.file);
+      v.written++;
+    }
+    v.count = 0;
+    v.rows = 0;
+    if (l + 1 < PYRAMID_LEVELS) {
+      add(l + 1, v.bucket);
+    }
+  }
+
+public:
+  ~PyramidWriter() { close(); }
+
+  bool create(const char *run) {
+    for (uint8_t l = 0; l < PYRAMID_LEVELS; l++) {
+      levels[l].file = fopen(pyramidPath(run, l).c_str(), "wb");
+      if (levels[l].file == nullptr) {
+        close();
+        return false;
+      }
+      PyramidHeader h;
+      memcpy(h.magic, PYRAMID_MAGIC, sizeof(h.magic));
+      h.signals = signals;
+      h.count = 0;
+      fwrite(&h, sizeof(h), 1, levels[l].file);
+      levels[l].count = 0;
+      levels[l].rows = 0;
+      levels[l].written = 0;
+    }
+    return true;
+  }
+
+  void append(uint32_t time, const int32_t *values) {
+    PyramidBucket b;
+    b.first = time;
+    b.last = time;
+    b.rows = 1;
+    for (uint32_t s = 0; s < signals; s++) {
+      b.values[s].min = values[s];
+      b.values[s].max = values[s];
+      b.values[s].mean = values[s];
+    }
+    add(0, b);
+  }
+
+  void flush() {
+    for (uint8_t l = 0; l < PYRAMID_LEVELS; l++) {
+      publish(l);
+    }
+  }
+
+  // Незаполненные ячейки записываются как есть, чтобы был виден конец запуска
+  void close() {
+    for (uint8_t l = 0; l < PYRAMID_LEVELS; l++) {
+      emit(l);
+    }
+    for (uint8_t l = 0; l < PYRAMID_LEVELS; l++) {
+      publish(l);
+      if (levels[l].file != nullptr) {
+        fclose(levels[l].file);
+        levels[l].file = nullptr;
+      }
+    }
+  }
+};
+
+class PyramidReader {
+private:
+  const ArchiveReader &archive;
+  const uint8_t *maps[PYRAMID_LEVELS];
+  const PyramidBucket *buckets[PYRAMID_LEVELS];
+  size_t counts[PYRAMID_LEVELS];
+  size_t sizes[PYRAMID_LEVELS];
+
+  size_t lowerBound(uint8_t l, uint32_t time) const {
+    size_t lo = 0;
+    size_t hi = counts[l];
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if (buckets[l][mid].last < time) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo;
+  }
+
+  // неполные крайние записи и строки хвоста весят по числу своих строк
+  static void merge(PyramidBucket &to, const PyramidBucket &b, uint32_t s,
+                    int64_t &sum, uint64_t &n) {
+    PyramidValue &p = to.values[s];
+    p.min = b.values[s].min < p.min ? b.values[s].min : p.min;
+    p.max = b.values[s].max > p.max ? b.values[s].max : p.max;
+    sum += static_cast<int64_t>(b.values[s].mean) * b.rows;
+    n += b.rows;
+  }
+
+  PyramidBucket rowBucket(uint32_t row, uint32_t signals) const {
+    PyramidBucket b;
+    b.first = b.last = archive.time(row);
+    b.rows = 1;
+    for (uint32_t s = 0; s < signals; s++) {
+      int32_t v = archive.value(s, row);
+      b.values[s].min = b.values[s].max = b.values[s].mean = v;
+    }
+    return b;
+  }
+
+public:
+  PyramidReader(const ArchiveReader &archive, const char *run)
+      : archive(archive) {
+    for (uint8_t l = 0; l < PYRAMID_LEVELS; l++) {
+      maps[l] = nullptr;
+      buckets[l] = nullptr;
+      counts[l] = 0;
+      sizes[l] = 0;
+      int fd = ::open(pyramidPath(run, l).c_str(), O_RDONLY);
+      if (fd < 0) {
+        continue;
+      }
+      struct stat st;
+      if (fstat(fd, &st) == 0 &&
+          static_cast<size_t>(st.st_size) >= sizeof(PyramidHeader)) {
+        void *m = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (m != MAP_FAILED) {
+          maps[l] = static_cast<const uint8_t *>(m);
+          sizes[l] = st.st_size;
+        }
+      }
+      ::close(fd);
+      // уровни другой версии телеметрии не используются
+      const PyramidHeader *h = reinterpret_cast<const PyramidHeader *>(maps[l]);
+      if (h != nullptr &&
+          memcmp(h->magic, PYRAMID_MAGIC, sizeof(h->magic)) == 0 &&
+          h->signals == TELEMETRY_FIELDS) {
+        buckets[l] =
+            reinterpret_cast<const PyramidBucket *>(maps[l] + sizeof(*h));
+        size_t n = (sizes[l] - sizeof(*h)) / sizeof(PyramidBucket);
+        size_t c = __atomic_load_n(&h->count, __ATOMIC_ACQUIRE);
+        counts[l] = c < n ? c : n;
+      }
+    }
+  }
+
+  ~PyramidReader() {
+    for (uint8_t l = 0; l < PYRAMID_LEVELS; l++) {
+      if (maps[l] != nullptr) {
+        munmap(const_cast<uint8_t *>(maps[l]), sizes[l]);
+      }
+    }
+  }
+
+  bool hasLevels() const { return counts[0] > 0; }
+
+  // Не больше points точек за [from, to]: берётся самый подробный уровень,
+  // у которого в интервал попадает не больше points записей, остаток
+  // сводится в нужное число точек на лету
+  std::vector<PyramidBucket> query(uint32_t from, uint32_t to,
+                                   uint32_t points) const {
+    std::vector<PyramidBucket> result;
+    if (points == 0) {
+      return result;
+    }
+    uint32_t signals = archive.signals() < TELEMETRY_FIELDS
+                           ? archive.signals()
+                           : static_cast<uint32_t>(TELEMETRY_FIELDS);
+    std::vector<PyramidBucket> source;
+    uint32_t row = archive.lowerBound(from);
+    uint32_t end = to == UINT32_MAX ? archive.rows() : archive.lowerBound(to + 1);
+    int level = -1;
+    if (end - row > points) {
+      for (uint8_t l = 0; l < PYRAMID_LEVELS; l++) {
+        if (counts[l] == 0) {
+          break;
+        }
+        level = l;
+        if ((end - row) / PYRAMID_FACTORS[l] <= points) {
+          break;
+        }
+      }
+    }
+    // записи уровня берутся только целиком внутри [from, to]: края
+    // интервала и хвост идущей записи, ещё не попавший в уровень, берутся
+    // строками из архива
+    if (level >= 0) {
+      const PyramidBucket *b = buckets[level];
+      size_t i = lowerBound(level, from);
+      if (i < counts[level] && b[i].first < from) {
+        i++;
+      }
+      size_t j = i;
+      while (j < counts[level] && b[j].last <= to) {
+        j++;
+      }
+      if (j > i) {
+        for (; row < end && archive.time(row) < b[i].first; row++) {
+          source.push_back(rowBucket(row, signals));
+        }
+        source.insert(source.end(), b + i, b + j);
+        row = archive.lowerBound(b[j - 1].last + 1);
+      }
+    }
+    for (; row < end; row++) {
+      source.push_back(rowBucket(row, signals));
+    }
+    if (source.size() <= points) {
+      return source;
+    }
+    for (uint32_t p = 0; p < points; p++) {
+      size_t a = source.size() * p / points;
+      size_t b = source.size() * (p + 1) / points;
+      PyramidBucket m = source[a];
+      m.last = source[b - 1].last;
+      m.rows = 0;
+      for (size_t i = a; i < b; i++) {
+        m.rows += source[i].rows;
+      }
+      for (uint32_t s = 0; s < signals; s++) {
+        int64_t sum = 0;
+        uint64_t n = 0;
+        for (size_t i = a; i < b; i++) {
+          merge(m, source[i], s, sum, n);
+        }
+        m.values[s].mean = static_cast<int32_t>(sum / n);
+      }
+      result.push_back(m);
+    }
+    return result;
+  }
+};
+
+#endif
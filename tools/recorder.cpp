@@ -0,0 +1,203 @@
+// Запись телеметрии контроллера в архив: каждый запуск колонны (от выхода
+// из OFF до END, OFF или ошибки) пишется в отдельный файл DIR/nodeN-ДАТА.run
+// со снимком настроек Data на момент старта. Рядом пишутся прореженные
+// уровни для графиков (pyramid.h).
+//
+// Сборка из корня проекта:
+//   g++ -std=c++11 -O2 -Ilib/PacketLib -Ilib/TelemetryLib tools/recorder.cpp
+//       lib/PacketLib/Packet.cpp lib/TelemetryLib/Telemetry.cpp -o recorder
+//
+// recorder PORT DIR [-b BAUD] [-a ADDRESS] [-i INTERVAL_MS]
+// Без -a слушает телеметрию, которую контроллер шлёт сам; с -a опрашивает
+// узел на шине раз в INTERVAL_MS.
+
+#include "archive.h"
+#include "port.h"
+#include "pyramid.h"
+#include <Protocol.h>
+#include <Telemetry.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define TIMEOUT 500
+#define SYNC_ROWS 60
+
+static volatile sig_atomic_t stop = 0;
+
+static void onSignal(int) { stop = 1; }
+
+static bool isRunning(int32_t status) {
+  return status != OFF && status != END && status != ERROR_TSA &&
+         status != ERROR_BARD;
+}
+
+static int64_t nowMillis() { return static_cast<int64_t>(nowMicros() / 1000); }
+
+static int usage() {
+  fprintf(stderr, "usage: recorder PORT DIR [-b BAUD] [-a ADDRESS] "
+                  "[-i INTERVAL_MS]\n");
+  return 2;
+}
+
+class Recorder {
+private:
+  Port &port;
+  const char *dir;
+  uint8_t node;
+  Telemetry telemetry;
+  ArchiveWriter writer;
+  PyramidWriter pyramid;
+  int64_t start = 0;
+  uint32_t rows = 0;
+
+  bool begin() {
+    Packet p;
+    p.init(PACKET_BLOCK_READ, nullptr, 0);
+    Packet *r = port.request(p, PACKET_BLOCK_READ, TIMEOUT);
+    const uint8_t *settings = nullptr;
+    uint8_t length = 0;
+    if (r != nullptr && r->getId() == PACKET_BLOCK_READ) {
+      settings = r->getPayload();
+      length = r->getLength();
+    } else {
+      fprintf(stderr, "no settings snapshot, recording without it\n");
+    }
+    start = nowMillis();
+    time_t t = start / 1000;
+    struct tm tm;
+    localtime_r(&t, &tm);
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/node%u-%04d%02d%02d-%02d%02d%02d.run",
+             dir, node, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+             tm.tm_hour, tm.tm_min, tm.tm_sec);
+    if (!writer.create(path, start, node, settings, length)) {
+      perror(path);
+      return false;
+    }
+    if (!pyramid.create(path)) {
+      perror(path);
+    }
+    printf("run started: %s\n", path);
+    fflush(stdout);
+    rows = 0;
+    return true;
+  }
+
+  void end() {
+    writer.close();
+    pyramid.close();
+    printf("run finished: %u rows\n", rows);
+    fflush(stdout);
+  }
+
+public:
+  Recorder(Port &port, const char *dir, uint8_t node)
+      : port(port), dir(dir), node(node) {}
+
+  ~Recorder() {
+    if (writer.isOpen()) {
+      end();
+    }
+  }
+
+  Telemetry &getTelemetry() { return telemetry; }
+
+  void sample() {
+    int32_t v[TELEMETRY_FIELDS];
+    for (uint8_t x = 0; x < TELEMETRY_FIELDS; x++) {
+      v[x] = telemetry.get(x);
+    }
+    bool running = isRunning(v[TM_STATUS]);
+    if (!writer.isOpen()) {
+      if (!running || !begin()) {
+        return;
+      }
+    }
+    if (writer.isFull()) {
+      end();
+      if (!begin()) {
+        return;
+      }
+    }
+    uint32_t time = static_cast<uint32_t>(nowMillis() - start);
+    writer.append(time, v);
+    pyramid.append(time, v);
+    rows++;
+    if (rows % SYNC_ROWS == 0) {
+      writer.sync();
+      pyramid.flush();
+    }
+    if (!running) {
+      end();
+    }
+  }
+};
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    return usage();
+  }
+  unsigned long baud = 9600;
+  long address = ADDRESS_NONE;
+  int interval = 1000;
+  for (int a = 3; a < argc; a += 2) {
+    if (argv[a][0] != '-' || a + 1 >= argc) {
+      return usage();
+    }
+    long v = strtol(argv[a + 1], nullptr, 0);
+    switch (argv[a][1]) {
+    case 'b':
+      baud = v;
+      break;
+    case 'a':
+      address = v;
+      break;
+    case 'i':
+      interval = v;
+      break;
+    default:
+      return usage();
+    }
+  }
+  if (address < ADDRESS_NONE || address >= ADDRESS_BROADCAST) {
+    return usage();
+  }
+  Port port;
+  if (!port.open(argv[1], baud)) {
+    perror(argv[1]);
+    return 1;
+  }
+  port.setAddress(static_cast<uint8_t>(address));
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  Recorder recorder(port, argv[2], static_cast<uint8_t>(address));
+  Telemetry &t = recorder.getTelemetry();
+  uint64_t next = nowMicros();
+  bool key = true; //после таймаута просить ключевой кадр
+  while (!stop) {
+    Packet *r;
+    if (address != ADDRESS_NONE) {
+      uint64_t now = nowMicros();
+      if (next > now) {
+        usleep(next - now);
+      }
+      next += static_cast<uint64_t>(interval) * 1000;
+      Packet p;
+      uint8_t k = TELEMETRY_KEY;
+      p.init(PACKET_TELEMETRY, &k, key || !t.isSynced() ? 1 : 0);
+      r = port.request(p, PACKET_TELEMETRY, TIMEOUT);
+      key = r == nullptr;
+    } else {
+      r = port.receive(interval * 2);
+    }
+    if (r == nullptr || r->getId() != PACKET_TELEMETRY) {
+      continue;
+    }
+    if (t.decode(r->getPayload(), r->getLength())) {
+      recorder.sample();
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,298 @@
+// Просмотр и сравнение архивов запусков, записанных recorder.
+//
+// Сборка из корня проекта:
+//   g++ -std=c++11 -O2 -pthread -Ilib/PacketLib -Ilib/TelemetryLib
+//       tools/runs.cpp -o runs
+//
+// runs info FILE...                  - сводка по запускам
+// runs dump FILE [FROM TO]           - строки за интервал, секунды от начала
+// runs plot FILE FROM TO N [SIGNAL]  - не больше N точек min/max/среднее
+// runs pyramid FILE...               - перестроить прореженные уровни
+// runs compare FILE...               - длительность этапов, литры, энергия
+
+#include "archive.h"
+#include "names.h"
+#include "pyramid.h"
+#include <Protocol.h>
+#include <atomic>
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <time.h>
+
+static const Status PHASES[] = {OVERCLOCK, STABILIZATION, HEAD,
+                                BODY,      TAIL,          PROCESS};
+#define PHASES_SIZE (sizeof(PHASES) / sizeof(PHASES[0]))
+
+struct RunSummary {
+  bool valid = false;
+  uint64_t phases[PHASES_SIZE]; //мс
+  uint64_t length = 0;          //мс
+  double liters = 0;
+  double product = 0;           //L отбора
+  double energy = 0;            //kWh
+  double phase_energy[PHASES_SIZE]; //kWh
+  bool rect = false;
+};
+
+static int usage() {
+  fprintf(stderr, "usage: runs info FILE...\n"
+                  "       runs dump FILE [FROM_S TO_S]\n"
+                  "       runs plot FILE FROM_S TO_S POINTS [SIGNAL]\n"
+                  "       runs pyramid FILE...\n"
+                  "       runs compare FILE...\n");
+  return 2;
+}
+
+static bool open(ArchiveReader &r, const char *file) {
+  if (!r.open(file)) {
+    fprintf(stderr, "%s: not a run archive\n", file);
+    return false;
+  }
+  return true;
+}
+
+static void printTime(uint64_t ms) {
+  uint64_t s = ms / 1000;
+  printf(" %3u:%02u", static_cast<unsigned>(s / 3600),
+         static_cast<unsigned>(s / 60 % 60));
+}
+
+static int info(int argc, char **argv) {
+  int result = 0;
+  for (int a = 0; a < argc; a++) {
+    ArchiveReader r;
+    if (!open(r, argv[a])) {
+      result = 1;
+      continue;
+    }
+    const ArchiveHeader &h = r.getHeader();
+    time_t t = h.start / 1000;
+    char date[32];
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&t));
+    uint32_t n = r.rows();
+    uint32_t length = n > 0 ? r.time(n - 1) / 1000 : 0;
+    printf("%s: node %u start %s rows %u length %02u:%02u:%02u%s\n", argv[a],
+           h.node, date, n, length / 3600, length / 60 % 60, length % 60,
+           h.closed ? "" : " (recording)");
+  }
+  return result;
+}
+
+static int dump(int argc, char **argv) {
+  ArchiveReader r;
+  if (!open(r, argv[0])) {
+    return 1;
+  }
+  uint32_t from = 0;
+  uint32_t to = UINT32_MAX;
+  if (argc == 3) {
+    from = strtoul(argv[1], nullptr, 10) * 1000;
+    to = strtoul(argv[2], nullptr, 10) * 1000;
+  }
+  uint32_t n = r.rows();
+  for (uint32_t row = r.lowerBound(from); row < n && r.time(row) <= to;
+       row++) {
+    printf("%.3f", r.time(row) / 1000.0);
+    for (uint32_t s = 0; s < r.signals(); s++) {
+      printf(" %ld", static_cast<long>(r.value(s, row)));
+    }
+    printf("\n");
+  }
+  return 0;
+}
+
+static int plot(int argc, char **argv) {
+  ArchiveReader r;
+  if (!open(r, argv[0])) {
+    return 1;
+  }
+  uint32_t from = strtoul(argv[1], nullptr, 10) * 1000;
+  uint32_t to = strtoul(argv[2], nullptr, 10) * 1000;
+  uint32_t points = strtoul(argv[3], nullptr, 10);
+  int signal = -1;
+  if (argc == 5) {
+    for (uint32_t s = 0; s < TELEMETRY_FIELDS; s++) {
+      if (strcmp(TELEMETRY_NAMES[s], argv[4]) == 0) {
+        signal = s;
+      }
+    }
+    if (signal < 0 || static_cast<uint32_t>(signal) >= r.signals()) {
+      fprintf(stderr, "unknown signal %s\n", argv[4]);
+      return 2;
+    }
+  }
+  PyramidReader p(r, argv[0]);
+  std::vector<PyramidBucket> v = p.query(from, to, points);
+  uint32_t signals = r.signals() < TELEMETRY_FIELDS
+                         ? r.signals()
+                         : static_cast<uint32_t>(TELEMETRY_FIELDS);
+  for (const PyramidBucket &b : v) {
+    printf("%.3f %.3f", b.first / 1000.0, b.last / 1000.0);
+    for (uint32_t s = 0; s < signals; s++) {
+      if (signal < 0 || static_cast<uint32_t>(signal) == s) {
+        printf(" %ld %ld %ld", static_cast<long>(b.values[s].min),
+               static_cast<long>(b.values[s].max),
+               static_cast<long>(b.values[s].mean));
+      }
+    }
+    printf("\n");
+  }
+  return 0;
+}
+
+static int pyramid(int argc, char **argv) {
+  int result = 0;
+  for (int a = 0; a < argc; a++) {
+    ArchiveReader r;
+    PyramidWriter w;
+    if (!open(r, argv[a])) {
+      result = 1;
+      continue;
+    }
+    if (!w.create(argv[a])) {
+      perror(argv[a]);
+      result = 1;
+      continue;
+    }
+    int32_t v[TELEMETRY_FIELDS];
+    memset(v, 0, sizeof(v));
+    uint32_t signals = r.signals() < TELEMETRY_FIELDS
+                           ? r.signals()
+                           : static_cast<uint32_t>(TELEMETRY_FIELDS);
+    for (uint32_t row = 0; row < r.rows(); row++) {
+      for (uint32_t s = 0; s < signals; s++) {
+        v[s] = r.value(s, row);
+      }
+      w.append(r.time(row), v);
+    }
+  }
+  return result;
+}
+
+// Интервал до следующей строки относится к этапу текущей строки
+static RunSummary summarize(const char *file) {
+  RunSummary sum;
+  memset(sum.phases, 0, sizeof(sum.phases));
+  memset(sum.phase_energy, 0, sizeof(sum.phase_energy));
+  ArchiveReader r;
+  if (!r.open(file)) {
+    return sum;
+  }
+  uint32_t n = r.rows();
+  bool power = r.signals() > TM_POWER;
+  // старые архивы без счётчика: энергия по заданной мощности
+  bool metered = r.signals() > TM_PRODUCT;
+  for (uint32_t row = 0; row + 1 < n; row++) {
+    uint32_t dt = r.time(row + 1) - r.time(row);
+    int32_t status = r.value(TM_STATUS, row);
+    double e = 0; //kWh
+    if (metered) {
+      e = (r.value(TM_ENERGY, row + 1) - r.value(TM_ENERGY, row)) / 1000.0;
+    } else if (power) {
+      e = static_cast<double>(r.value(TM_POWER, row)) * dt / 3.6e9;
+    }
+    for (uint8_t p = 0; p < PHASES_SIZE; p++) {
+      if (PHASES[p] == status) {
+        sum.phases[p] += dt;
+        sum.phase_energy[p] += e;
+      }
+    }
+    sum.energy += e;
+  }
+  if (n > 0) {
+    sum.length = r.time(n - 1);
+    // счётчик насоса идёт от включения, а не от начала запуска
+    sum.liters = (r.value(TM_LITERS, n - 1) - r.value(TM_LITERS, 0)) / 10.0;
+    sum.rect = r.value(TM_MODE, n - 1) == RECT_MODE;
+    if (metered) {
+      sum.product = r.value(TM_PRODUCT, n - 1) / 1000.0;
+    }
+  }
+  sum.valid = true;
+  return sum;
+}
+
+static int compare(int argc, char **argv) {
+  std::vector<RunSummary> sums(argc);
+  std::atomic<int> next(0);
+  unsigned workers = std::thread::hardware_concurrency();
+  if (workers == 0) {
+    workers = 1;
+  }
+  if (workers > static_cast<unsigned>(argc)) {
+    workers = argc;
+  }
+  std::vector<std::thread> threads;
+  for (unsigned w = 0; w < workers; w++) {
+    threads.push_back(std::thread([&]() {
+      for (int a; (a = next++) < argc;) {
+        sums[a] = summarize(argv[a]);
+      }
+    }));
+  }
+  for (std::thread &t : threads) {
+    t.join();
+  }
+  printf("run                             overclk   stab   head   body   tail"
+         " process  total  liters product    kWh  kWh/L\n");
+  int result = 0;
+  for (int a = 0; a < argc; a++) {
+    const RunSummary &s = sums[a];
+    if (!s.valid) {
+      fprintf(stderr, "%s: not a run archive\n", argv[a]);
+      result = 1;
+      continue;
+    }
+    const char *name = strrchr(argv[a], '/');
+    printf("%-30.30s", name != nullptr ? name + 1 : argv[a]);
+    for (uint8_t p = 0; p < PHASES_SIZE; p++) {
+      printTime(s.phases[p]);
+    }
+    printTime(s.length);
+    // на литр браги в НБК, на литр отбора в ректификации
+    double volume = s.rect ? s.product : s.liters;
+    printf(" %7.1f %7.2f %6.2f %6.3f\n", s.liters, s.product, s.energy,
+           volume > 0 ? s.energy / volume : 0);
+  }
+  printf("\nkWh by phase                    overclk   stab   head   body   tail"
+         " process\n");
+  for (int a = 0; a < argc; a++) {
+    const RunSummary &s = sums[a];
+    if (!s.valid) {
+      continue;
+    }
+    const char *name = strrchr(argv[a], '/');
+    printf("%-30.30s", name != nullptr ? name + 1 : argv[a]);
+    for (uint8_t p = 0; p < PHASES_SIZE; p++) {
+      printf(" %6.2f", s.phase_energy[p]);
+    }
+    printf("\n");
+  }
+  return result;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    return usage();
+  }
+  const char *cmd = argv[1];
+  argc -= 2;
+  argv += 2;
+  if (strcmp(cmd, "info") == 0) {
+    return info(argc, argv);
+  }
+  if (strcmp(cmd, "dump") == 0 && (argc == 1 || argc == 3)) {
+    return dump(argc, argv);
+  }
+  if (strcmp(cmd, "plot") == 0 && (argc == 4 || argc == 5)) {
+    return plot(argc, argv);
+  }
+  if (strcmp(cmd, "pyramid") == 0) {
+    return pyramid(argc, argv);
+  }
+  if (strcmp(cmd, "compare") == 0) {
+    return compare(argc, argv);
+  }
+  return usage();
+}